@@ -7,7 +7,7 @@ mkdir -p isodir/boot/grub
 cp sysroot/kernel/boot/SwallowOS.kernel isodir/boot/SwallowOS.kernel
 cat > isodir/boot/grub/grub.cfg << EOF
 menuentry "SwallowOS" {
-    multiboot /boot/SwallowOS.kernel
+    multiboot /boot/SwallowOS.kernel ${KERNEL_CMDLINE}
 }
 EOF
 grub-mkrescue -o SwallowOS.iso isodir
\ No newline at end of file
@@ -41,6 +41,7 @@ stack_top:
 .global page_map_level4
 page_map_level4:
         .skip 4096                # size 512 * 8, above the same size
+.global kernel_page_directory_ptr
 kernel_page_directory_ptr:
         .skip 4096
 vga_page_directory:
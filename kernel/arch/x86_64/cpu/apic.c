@@ -0,0 +1,140 @@
+#include <stdint.h>
+#include <kernel/idt.h>
+#include <kernel/timer.h>
+#include "../mm/pgtable.h"
+#include "../sched/task.h"
+#include "cpu.h"
+#include "smp.h"
+#include "apic.h"
+
+#define IA32_APIC_BASE_MSR          0x1B
+#define APIC_BASE_ENABLE            (1 << 11)
+
+#define LAPIC_ID                    0x020
+#define LAPIC_EOI                   0x0B0
+#define LAPIC_SVR                   0x0F0
+#define LAPIC_ICR_LOW               0x300
+#define LAPIC_ICR_HIGH              0x310
+#define LAPIC_LVT_TIMER             0x320
+#define LAPIC_TIMER_INIT            0x380
+#define LAPIC_TIMER_CURRENT         0x390
+#define LAPIC_TIMER_DIV             0x3E0
+
+#define SVR_ENABLE                  (1 << 8)
+#define LVT_MASKED                  (1 << 16)
+#define LVT_TIMER_PERIODIC          (1 << 17)
+#define TIMER_DIV_16                0x3
+
+#define ICR_INIT                    (5 << 8)
+#define ICR_STARTUP                 (6 << 8)
+#define ICR_ASSERT                  (1 << 14)
+#define ICR_DELIVERY_PENDING        (1 << 12)
+#define ICR_ALL_EXCLUDING_SELF      (3 << 18)
+
+#define CALIBRATE_US               10000
+#define IDT_DESCRIPTOR_EXTERNAL     0x8E        /* present, 64位中断门 */
+
+/* LAPIC的MMIO在第4个GB中，用一个不缓存的1GB页恒等映射 */
+#define APIC_MMIO_PDPT_INDEX        3
+#define PDPT_1G_UNCACHED            0x9B        /* P | RW | PWT | PCD | PS */
+
+extern void lapic_timer_stub(void);
+extern void resched_ipi_stub(void);
+extern void spurious_stub(void);
+
+static volatile uint32_t *lapic = NULL;
+static uint32_t lapic_ticks_per_tick = 0;       /* 分频16后，每个系统tick的LAPIC计数，BSP校准一次，所有CPU共用 */
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static void lapic_enable(void) {
+    wrmsr(IA32_APIC_BASE_MSR, rdmsr(IA32_APIC_BASE_MSR) | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+/* 用PIT的通道2测出LAPIC定时器的频率 */
+static void lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    pit_delay(CALIBRATE_US);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    lapic_ticks_per_tick = (uint64_t)elapsed * 1000000 / CALIBRATE_US / TIMER_HZ;
+}
+
+/* BSP调用：映射并开启LAPIC，校准定时器，注册LAPIC的中断向量；BSP的tick仍然来自PIT */
+void lapic_init(void) {
+    uint64_t base = rdmsr(IA32_APIC_BASE_MSR) & ~0xFFFUL;
+    uint64_t *pdpt = (uint64_t *)&kernel_page_directory_ptr;
+
+    pdpt[APIC_MMIO_PDPT_INDEX] = (APIC_MMIO_PDPT_INDEX * 0x40000000UL) | PDPT_1G_UNCACHED;
+    __asm__ volatile ("invlpg (%0)" : : "r"(base) : "memory");
+    lapic = (volatile uint32_t *)base;
+
+    idt_set_descriptor(LAPIC_TIMER_VECTOR, lapic_timer_stub, IDT_DESCRIPTOR_EXTERNAL);
+    idt_set_descriptor(RESCHED_IPI_VECTOR, resched_ipi_stub, IDT_DESCRIPTOR_EXTERNAL);
+    idt_set_descriptor(LAPIC_SPURIOUS_VECTOR, spurious_stub, IDT_DESCRIPTOR_EXTERNAL);
+
+    lapic_enable();
+    lapic_timer_calibrate();
+}
+
+/* AP调用：开启LAPIC，定时器以TIMER_HZ周期运行，但先屏蔽，等有任务时由timer_tick_start放开 */
+void lapic_init_ap(void) {
+    lapic_enable();
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LVT_TIMER_PERIODIC | LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, lapic_ticks_per_tick);
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static void lapic_icr_wait(void) {
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING)
+        cpu_relax();
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    unsigned long flags = irq_save();
+    lapic_icr_wait();
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, ICR_ASSERT | vector);
+    irq_restore(flags);
+}
+
+/* 向除自己外的所有CPU广播INIT-SIPI-SIPI，AP从物理地址page*4K处的实模式代码开始执行 */
+void lapic_send_init_sipi_all(uint8_t page) {
+    lapic_icr_wait();
+    lapic_write(LAPIC_ICR_LOW, ICR_ALL_EXCLUDING_SELF | ICR_ASSERT | ICR_INIT);
+    pit_delay(10000);
+    for (unsigned int i = 0; i < 2; ++i) {
+        lapic_icr_wait();
+        lapic_write(LAPIC_ICR_LOW, ICR_ALL_EXCLUDING_SELF | ICR_ASSERT | ICR_STARTUP | page);
+        pit_delay(200);
+    }
+    lapic_icr_wait();
+}
+
+/* 屏蔽/放开本CPU的LAPIC定时器，周期计数不受影响 */
+void lapic_timer_set_masked(int masked) {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LVT_TIMER_PERIODIC | (masked ? LVT_MASKED : 0));
+}
+
+/* AP的tick */
+void lapic_timer_handler(void) {
+    lapic_eoi();
+    task_hook_in_timer_handler();
+}
@@ -0,0 +1,19 @@
+#ifndef _APIC_H
+#define _APIC_H
+
+#include <stdint.h>
+
+#define LAPIC_TIMER_VECTOR           0x40
+#define RESCHED_IPI_VECTOR           0x41
+#define LAPIC_SPURIOUS_VECTOR        0xFF
+
+void lapic_init(void);
+void lapic_init_ap(void);
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+void lapic_send_init_sipi_all(uint8_t page);
+void lapic_timer_set_masked(int masked);
+void lapic_timer_handler(void);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef _CPU_H
 #define _CPU_H
 
+#include <kernel/spinlock.h>     /* irq_save, irq_restore, cpu_relax */
+
 struct pt_regs {
 /*
  * C ABI says these regs are callee-preserved. They aren't saved on kernel entry
@@ -43,4 +45,29 @@ extern void set_ring0_msr(void *user_func);
 extern unsigned int getcr2();
 extern unsigned int getcr3();
 
+#define MSR_GS_BASE             0xC0000101
+#define RFLAGS_IF                    0x200
+
+static inline unsigned long rdmsr(unsigned int msr) {
+    unsigned int lo, hi;
+    __asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((unsigned long)hi << 32) | lo;
+}
+
+static inline void wrmsr(unsigned int msr, unsigned long value) {
+    __asm__ volatile ("wrmsr" : : "c"(msr), "a"((unsigned int)value), "d"((unsigned int)(value >> 32)));
+}
+
+static inline void cpuid(unsigned int leaf, unsigned int subleaf,
+                         unsigned int *a, unsigned int *b, unsigned int *c, unsigned int *d) {
+    __asm__ volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(subleaf));
+}
+
+/* read time-stamp counter */
+static inline unsigned long rdtsc(void) {
+    unsigned int lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long)hi << 32) | lo;
+}
+
 #endif
\ No newline at end of file
@@ -6,7 +6,7 @@ get_to_ring3:
     movw %ax, %ds
     movw %ax, %es
     movw %ax, %fs
-    movw %ax, %gs
+    # gs的基址指向per-CPU数据，不能重新加载gs
 
     mov $0xc0000080, %rcx
     rdmsr
@@ -24,13 +24,16 @@ get_to_ring3:
     # save rsp to tss_rsp0
     # mov %rsp, tss_rsp0
 
-    # save current_task_TCB->tss_rsp0 to tss_rsp0
-    mov current_task_TCB(%rip), %rsi
+    # save current_task_TCB->tss_rsp0 to this cpu's tss
+    mov cpu_current_offset(%rip), %rdx
+    mov %gs:(%rdx), %rsi
     mov TCB_mm_offset(%rip), %rdx
     mov (%rsi, %rdx, 1), %rsi           # load mm into %rsi
     mov mm_tss_rsp0_offset(%rip), %rdx
-    mov (%rsi, %rdx, 1), %rdx
-    mov %rdx, tss_rsp0
+    mov (%rsi, %rdx, 1), %rax
+    mov cpu_tss_rsp0_offset(%rip), %rdx
+    mov %gs:(%rdx), %rdx
+    mov %rax, (%rdx)
 
     # load current_task_TCB->rsp
     mov mm_rsp_offset(%rip), %rdx
@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <kernel/page.h>
+#include <kernel/string.h>
+#include <kernel/printk.h>
+#include "../mm/pagemanager.h"
+#include "../sched/task.h"
+#include "cpu.h"
+#include "smp.h"
+#include "fpu.h"
+
+#define CR0_MP                      (1 << 1)
+#define CR0_EM                      (1 << 2)
+#define CR0_TS                      (1 << 3)
+#define CR0_NE                      (1 << 5)
+#define CR4_OSFXSR                  (1 << 9)
+#define CR4_OSXMMEXCPT              (1 << 10)
+#define CR4_OSXSAVE                 (1 << 18)
+
+#define CPUID_1_ECX_XSAVE           (1 << 26)
+#define CPUID_D_1_EAX_XSAVEOPT      (1 << 0)
+#define XSTATE_WANTED               0x7         /* x87, SSE, AVX */
+
+#define FXSAVE_SIZE                 512
+#define FPU_DEFAULT_FCW             0x037f      /* 屏蔽所有x87异常，64位精度 */
+#define FPU_DEFAULT_MXCSR           0x1f80      /* 屏蔽所有SSE异常 */
+
+static int fpu_use_xsave = 0;
+static int fpu_use_xsaveopt = 0;
+static int fpu_eager = 0;
+static uint64_t fpu_xcr0 = 0;
+static unsigned int fpu_state_size = FXSAVE_SIZE;
+
+static inline unsigned long read_cr0(void) {
+    unsigned long v;
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(unsigned long v) {
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(v) : "memory");
+}
+
+static inline unsigned long read_cr4(void) {
+    unsigned long v;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(unsigned long v) {
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+static inline void xsetbv(unsigned int xcr, uint64_t v) {
+    __asm__ volatile ("xsetbv" : : "c"(xcr), "a"((unsigned int)v), "d"((unsigned int)(v >> 32)));
+}
+
+static inline void clts(void) {
+    __asm__ volatile ("clts" : : : "memory");
+}
+
+static inline void stts(void) {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+/* XSAVEOPT只写回上次XRSTOR之后改过的部分 */
+static void fpu_save(void *state) {
+    if (fpu_use_xsaveopt)
+        __asm__ volatile ("xsaveopt64 (%0)" : : "r"(state), "a"(-1), "d"(-1) : "memory");
+    else if (fpu_use_xsave)
+        __asm__ volatile ("xsave64 (%0)" : : "r"(state), "a"(-1), "d"(-1) : "memory");
+    else
+        __asm__ volatile ("fxsave64 (%0)" : : "r"(state) : "memory");
+}
+
+static void fpu_restore(void *state) {
+    if (fpu_use_xsave)
+        __asm__ volatile ("xrstor64 (%0)" : : "r"(state), "a"(-1), "d"(-1) : "memory");
+    else
+        __asm__ volatile ("fxrstor64 (%0)" : : "r"(state) : "memory");
+}
+
+/* 每个CPU都要做：打开SSE和XSAVE，设置XCR0，置TS让第一次使用陷入 */
+void fpu_init_cpu(void) {
+    write_cr0((read_cr0() & ~(unsigned long)CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+    unsigned long cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (fpu_use_xsave)
+        cr4 |= CR4_OSXSAVE;
+    write_cr4(cr4);
+    if (fpu_use_xsave)
+        xsetbv(0, fpu_xcr0);
+    this_cpu()->fpu_owner = NULL;
+    this_cpu()->fpu_active = 0;
+}
+
+/* BSP在init_scheduler中调用：检测XSAVE/XSAVEOPT，确定状态区大小和切换策略 */
+void fpu_init(int mode) {
+    unsigned int a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    fpu_use_xsave = (c & CPUID_1_ECX_XSAVE) != 0;
+    if (fpu_use_xsave) {
+        cpuid(0xd, 0, &a, &b, &c, &d);
+        fpu_xcr0 = a & XSTATE_WANTED;
+        cpuid(0xd, 1, &a, &b, &c, &d);
+        fpu_use_xsaveopt = (a & CPUID_D_1_EAX_XSAVEOPT) != 0;
+    }
+    fpu_init_cpu();
+    if (fpu_use_xsave) {
+        cpuid(0xd, 0, &a, &b, &c, &d);          /* ebx为按当前XCR0需要的大小 */
+        fpu_state_size = b;
+    }
+    if (fpu_state_size > PAGE_SIZE) {
+        fpu_use_xsave = fpu_use_xsaveopt = 0;
+        fpu_state_size = FXSAVE_SIZE;
+        fpu_init_cpu();
+    }
+
+    if (mode == FPU_MODE_AUTO)
+        fpu_eager = fpu_use_xsaveopt;
+    else
+        fpu_eager = (mode == FPU_MODE_EAGER);
+    printk("fpu: %s, %u bytes, %s\n", fpu_use_xsaveopt ? "xsaveopt" : fpu_use_xsave ? "xsave" : "fxsave",
+           (unsigned long)fpu_state_size, fpu_eager ? "eager" : "lazy");
+}
+
+/* 任务第一次用FPU时分配状态区（一页，满足XSAVE的64字节对齐），初始为复位后的状态。
+   XSAVE头部的XSTATE_BV为0，XRSTOR会把各部分置为初始值，只有MXCSR从内存读 */
+static void *fpu_state_alloc(void) {
+    struct page_alloc pa = alloc_pages(1);
+    if (!pa.page)
+        return NULL;
+    memset(pa.page, 0, PAGE_SIZE);
+    *(uint16_t *)pa.page = FPU_DEFAULT_FCW;
+    *(uint32_t *)((char *)pa.page + 24) = FPU_DEFAULT_MXCSR;
+    return pa.page;
+}
+
+/* 调用者持有本CPU的队列锁：离开的任务这个时间片用过FPU就保存，寄存器里仍是它的状态，
+   之后没有别的任务装入、它又回到这个CPU时不用再恢复 */
+void fpu_switch(struct thread_control_block *prev, struct thread_control_block *next) {
+    struct cpu *c = this_cpu();
+    int was_active = c->fpu_active;
+    if (was_active)
+        fpu_save(prev->fpu_state);
+
+    if (fpu_eager && next->fpu_state) {
+        if (!was_active)
+            clts();
+        if (c->fpu_owner != next || next->fpu_cpu != c->id)
+            fpu_restore(next->fpu_state);
+        c->fpu_owner = next;
+        next->fpu_cpu = c->id;
+        c->fpu_active = 1;
+    } else {
+        if (was_active)
+            stts();
+        c->fpu_active = 0;
+    }
+}
+
+/* #NM，中断已关：当前任务用到了FPU而TS置位，装入它的状态后返回重新执行那条指令 */
+void fpu_trap(void) {
+    struct cpu *c = this_cpu();
+    struct thread_control_block *task = c->current;
+
+    if (!task->fpu_state) {
+        task->fpu_state = fpu_state_alloc();
+        if (!task->fpu_state) {
+            printk("fpu: no memory for task %u, terminated\n", task->task_id);
+            terminate_task();
+        }
+    }
+    clts();
+    if (c->fpu_owner != task || task->fpu_cpu != c->id)
+        fpu_restore(task->fpu_state);
+    c->fpu_owner = task;
+    task->fpu_cpu = c->id;
+    c->fpu_active = 1;
+}
+
+/* 回收任务时调用，任务已不在任何CPU上运行 */
+void fpu_release(struct thread_control_block *task) {
+    for (unsigned int i = 0; i < NR_CPUS; ++i)
+        if (cpus[i].fpu_owner == task)
+            cpus[i].fpu_owner = NULL;
+    if (task->fpu_state) {
+        struct page_alloc pa = { (pageframe_t)task->fpu_state, 1 };
+        free_pages(&pa);
+        task->fpu_state = NULL;
+    }
+}
+
+/* 内核代码要用SSE/AVX时包在这两个函数之间：先保存当前任务的状态，期间不能切换任务，也不能睡眠 */
+void kernel_fpu_begin(void) {
+    preempt_disable();
+    unsigned long flags = irq_save();
+    struct cpu *c = this_cpu();
+    if (c->fpu_active)
+        fpu_save(c->current->fpu_state);
+    else
+        clts();
+    c->fpu_owner = NULL;                        /* 寄存器里的内容不再属于任何任务 */
+    c->fpu_active = 0;
+    irq_restore(flags);
+}
+
+void kernel_fpu_end(void) {
+    stts();
+    preempt_enable();
+}
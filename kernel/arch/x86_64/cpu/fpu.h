@@ -0,0 +1,19 @@
+#ifndef _FPU_H
+#define _FPU_H
+
+struct thread_control_block;
+
+/* 切换策略：lazy时切入的任务总是先置CR0.TS，第一次用到FPU时由#NM装入它的状态；
+   eager时切入用过FPU的任务就直接装入，省掉一次#NM。没用过FPU的任务两种策略下都不用保存和恢复 */
+#define FPU_MODE_AUTO                   0       /* 有XSAVEOPT时eager，否则lazy */
+#define FPU_MODE_LAZY                   1
+#define FPU_MODE_EAGER                  2
+
+void fpu_init(int mode);
+void fpu_init_cpu(void);
+void fpu_switch(struct thread_control_block *prev, struct thread_control_block *next);
+void fpu_release(struct thread_control_block *task);
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+#endif
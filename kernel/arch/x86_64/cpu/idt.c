@@ -88,6 +88,11 @@ void load_idt() {
     // sti();
 }
 
+/* AP与BSP共用同一个IDT，只需加载 */
+void load_idt_ap(void) {
+    __asm__ volatile ("lidt %0" : : "m"(idtr));
+}
+
 void cli() {
     __asm__ volatile ("cli");
 }
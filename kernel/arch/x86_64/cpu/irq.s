@@ -1,14 +1,43 @@
-.section .text
-irq_stub_0:
-    callq timer_handler
+# 中断可能打断任意指令，C处理程序会改掉调用者保存的寄存器，处理程序中还可能切换任务，
+# 所以都要保存；进入时rsp按8对齐而不是16，压9个寄存器后call前正好16字节对齐
+.macro irq_stub name, handler
+\name:
+    push %rax
+    push %rcx
+    push %rdx
+    push %rsi
+    push %rdi
+    push %r8
+    push %r9
+    push %r10
+    push %r11
+    callq \handler
+    pop %r11
+    pop %r10
+    pop %r9
+    pop %r8
+    pop %rdi
+    pop %rsi
+    pop %rdx
+    pop %rcx
+    pop %rax
     iretq
+.endm
 
-irq_stub_1:
-    callq keyboard_handler
-    iretq
+.section .text
+irq_stub irq_stub_0, timer_handler
+irq_stub irq_stub_1, keyboard_handler
+irq_stub irq_stub_6, floppy_irq_handler
+
+# LAPIC的向量，由apic.c注册
+.global lapic_timer_stub
+irq_stub lapic_timer_stub, lapic_timer_handler
+
+.global resched_ipi_stub
+irq_stub resched_ipi_stub, resched_ipi_handler
 
-irq_stub_6:
-    callq floppy_irq_handler
+.global spurious_stub
+spurious_stub:
     iretq
 
 
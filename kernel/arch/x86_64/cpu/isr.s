@@ -18,7 +18,28 @@ isr_no_err_stub 3
 isr_no_err_stub 4
 isr_no_err_stub 5
 isr_no_err_stub 6
-isr_no_err_stub 7
+# #NM：CR0.TS置位时用到FPU/SSE，fpu_trap装入当前任务的状态后返回重新执行，所以要保存调用者保存的寄存器
+isr_stub_7:
+    push %rax
+    push %rcx
+    push %rdx
+    push %rsi
+    push %rdi
+    push %r8
+    push %r9
+    push %r10
+    push %r11
+    call fpu_trap
+    pop %r11
+    pop %r10
+    pop %r9
+    pop %r8
+    pop %rdi
+    pop %rsi
+    pop %rdx
+    pop %rcx
+    pop %rax
+    iretq
 isr_err_stub    8
 isr_no_err_stub 9
 isr_err_stub    10
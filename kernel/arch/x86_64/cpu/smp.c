@@ -0,0 +1,150 @@
+#include <stdint.h>
+#include <kernel/idt.h>
+#include <kernel/page.h>
+#include <kernel/string.h>
+#include <kernel/printk.h>
+#include <kernel/timer.h>
+#include "../include/defs.h"
+#include "../mm/pagemanager.h"
+#include "../mm/pcid.h"
+#include "../sched/task.h"
+#include "cpu.h"
+#include "apic.h"
+#include "fpu.h"
+#include "smp.h"
+
+#define AP_TRAMPOLINE                0x8000           /* 与trampoline.s一致 */
+#define AP_STACK_PAGE_NUM                 4           /* AP启动栈，之后作为该CPU idle任务的栈 */
+#define AP_BOOT_MIN_WAIT_US           10000
+#define AP_BOOT_TIMEOUT_US           100000
+#define AP_BOOT_POLL_US                1000
+#define TSS_AVAILABLE                  0x89
+
+struct gdt_ptr {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed));
+
+struct cpu cpus[NR_CPUS];
+unsigned int nr_cpus_online = 1;
+
+const uint64_t cpu_current_offset = offset_of(struct cpu, current);
+const uint64_t cpu_tss_rsp0_offset = offset_of(struct cpu, tss_rsp0);
+
+/* trampoline.s使用：AP按到达顺序取得序号，序号i对应cpus[i+1] */
+unsigned int ap_boot_count = 0;
+const unsigned int ap_boot_slots = NR_CPUS - 1;
+void *ap_boot_stacks[NR_CPUS - 1];
+static struct page_alloc ap_stacks[NR_CPUS - 1];
+
+extern char ap_trampoline_start[], ap_trampoline_end[];
+extern char ap_trampoline_cr3[], ap_trampoline_gdtr[];
+extern uint64_t tss_rsp0;
+extern void do_syscall();
+
+/* 在kernel_main最开始调用，之后才能使用this_cpu()和lock_scheduler */
+void smp_early_init(void) {
+    struct cpu *c = &cpus[0];
+    c->self = c;
+    c->id = 0;
+    c->online = 1;
+    c->tss_rsp0 = &tss_rsp0;
+    wrmsr(MSR_GS_BASE, (uint64_t)c);
+}
+
+/* 复制启动时的gdt，换上本CPU自己的tss；tss描述符ltr后是busy的，不能在CPU间共用 */
+static void gdt_load_percpu(struct cpu *c) {
+    struct gdt_ptr gdtr;
+    __asm__ volatile ("sgdt %0" : "=m"(gdtr));
+    memcpy(c->gdt, (void *)gdtr.base, sizeof(c->gdt));
+
+    uint64_t base = (uint64_t)&c->tss;
+    uint64_t limit = sizeof(struct tss) - 1;
+    c->gdt[GDT_TSS_SELECTOR / 8] = (limit & 0xffff) | ((base & 0xffffff) << 16) | ((uint64_t)TSS_AVAILABLE << 40)
+                                 | (((limit >> 16) & 0xf) << 48) | (((base >> 24) & 0xff) << 56);
+    c->gdt[GDT_TSS_SELECTOR / 8 + 1] = base >> 32;
+    c->tss.iopb = sizeof(struct tss);
+
+    gdtr.base = (uint64_t)c->gdt;
+    gdtr.limit = sizeof(c->gdt) - 1;
+    __asm__ volatile ("lgdt %0" : : "m"(gdtr));
+    __asm__ volatile ("ltr %w0" : : "r"((uint16_t)GDT_TSS_SELECTOR));
+}
+
+/* AP在ap_start64之后进入这里，当前的执行流成为该CPU的idle任务 */
+void ap_main(unsigned long slot) {
+    struct cpu *c = &cpus[slot + 1];
+
+    wrmsr(MSR_GS_BASE, (uint64_t)c);
+    load_idt_ap();
+    gdt_load_percpu(c);
+    c->apic_id = lapic_id();
+    lapic_init_ap();
+    set_ring0_msr(do_syscall);
+    fpu_init_cpu();
+    pcid_init_cpu();
+
+    lock_scheduler();
+    sched_init_ap();
+    c->online = 1;
+    nr_cpus_online++;
+    unlock_scheduler();
+
+    printk("cpu %u online, apic id %u\n", (unsigned long)c->id, (unsigned long)c->apic_id);
+    sti();
+    kernel_idle_work();
+}
+
+/* BSP调用，需在init_scheduler之后：开启LAPIC，启动所有AP并等待它们上线 */
+void smp_init(void) {
+    struct gdt_ptr gdtr;
+    unsigned int waited = 0, arrived = 0;
+
+    lapic_init();
+    cpus[0].apic_id = lapic_id();
+
+    for (unsigned int i = 1; i < NR_CPUS; ++i) {
+        struct cpu *c = &cpus[i];
+        c->self = c;
+        c->id = i;
+        c->tss_rsp0 = (uint64_t *)((char *)&c->tss + __builtin_offsetof(struct tss, rsp0));     /* rsp0在tss中不是8字节对齐的 */
+        c->tick_stopped = 1;
+        ap_stacks[i - 1] = alloc_pages(AP_STACK_PAGE_NUM);
+        if (ap_stacks[i - 1].page)
+            ap_boot_stacks[i - 1] = (char *)ap_stacks[i - 1].page + AP_STACK_PAGE_NUM * PAGE_SIZE;
+    }
+
+    /* 拷贝trampoline并填入页表和gdt */
+    char *trampoline = (char *)AP_TRAMPOLINE;
+    memcpy(trampoline, ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+    *(uint32_t *)(trampoline + (ap_trampoline_cr3 - ap_trampoline_start)) = getcr3() & CR3_ADDR_MASK;
+    __asm__ volatile ("sgdt %0" : "=m"(gdtr));
+    *(uint16_t *)(trampoline + (ap_trampoline_gdtr - ap_trampoline_start)) = gdtr.limit;
+    *(uint32_t *)(trampoline + (ap_trampoline_gdtr - ap_trampoline_start) + 2) = (uint32_t)gdtr.base;
+
+    lapic_send_init_sipi_all(AP_TRAMPOLINE >> 12);
+
+    /* 不知道有多少个AP，等到至少AP_BOOT_MIN_WAIT_US且已到达的AP都上线，或超时 */
+    while (waited < AP_BOOT_TIMEOUT_US) {
+        pit_delay(AP_BOOT_POLL_US);
+        waited += AP_BOOT_POLL_US;
+        arrived = __atomic_load_n(&ap_boot_count, __ATOMIC_ACQUIRE);
+        if (arrived > ap_boot_slots)
+            arrived = ap_boot_slots;
+        if (waited >= AP_BOOT_MIN_WAIT_US && __atomic_load_n(&nr_cpus_online, __ATOMIC_ACQUIRE) == arrived + 1)
+            break;
+    }
+
+    /* 关闭启动：之后才到的AP取到的序号不小于ap_boot_slots，会停下；没有用到的启动栈还回去 */
+    arrived = __atomic_exchange_n(&ap_boot_count, ap_boot_slots, __ATOMIC_ACQ_REL);
+    for (unsigned int i = arrived; i < ap_boot_slots; ++i) {
+        ap_boot_stacks[i] = NULL;
+        if (ap_stacks[i].page)
+            free_pages(&ap_stacks[i]);
+    }
+    printk("smp: %u cpus online\n", (unsigned long)nr_cpus_online);
+}
+
+void smp_send_resched(unsigned int cpu) {
+    lapic_send_ipi(cpus[cpu].apic_id, RESCHED_IPI_VECTOR);
+}
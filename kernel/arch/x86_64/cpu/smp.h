@@ -0,0 +1,72 @@
+#ifndef _SMP_H
+#define _SMP_H
+
+#include <stdint.h>
+#include <kernel/spinlock.h>
+
+#define NR_CPUS                         8
+#define GDT_ENTRIES                     8              /* null, code, data, user code32, user data, user code, tss(占两项) */
+#define GDT_TSS_SELECTOR             0x30
+
+struct thread_control_block;
+
+/* 64位tss，AP各有一个；BSP沿用boot.s中的tss_entry */
+struct tss {
+    uint32_t reserved0;
+    uint64_t rsp0;
+    uint64_t rsp1;
+    uint64_t rsp2;
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iopb;
+} __attribute__((packed));
+
+/* 每个CPU的数据区，gs的基址指向它，第一项指向自己 */
+struct cpu {
+    struct cpu *self;
+    unsigned int id;                        /* 逻辑编号，BSP为0 */
+    unsigned int apic_id;
+    int online;
+    struct thread_control_block *current;   /* 当前任务 */
+    struct thread_control_block *idle_task;
+    uint64_t *tss_rsp0;                     /* 本CPU tss中rsp0的地址 */
+    int lock_depth;                         /* lock_scheduler的嵌套层数 */
+    struct mcs_node sched_node;             /* 在调度器锁上排队用的节点 */
+    unsigned long sched_irq_flags;          /* 最外层lock_scheduler之前的rflags */
+    int preempt_count;                      /* 不为0时推迟任务切换 */
+    int resched_postponed;                  /* 推迟期间有过schedule */
+    int need_resched;                       /* 有被唤醒的任务要抢占当前任务 */
+    int tick_stopped;                       /* 本CPU的tick已停（tickless） */
+    unsigned long rcu_qs;                   /* 经过RCU静止状态的次数 */
+    struct thread_control_block *fpu_owner; /* FPU寄存器中是谁的状态，NULL表示不属于任何任务 */
+    int fpu_active;                         /* CR0.TS已清，寄存器中是当前任务正在用的状态 */
+    uint64_t cr3;                           /* 本CPU当前CR3的值（含PCID） */
+    struct tss tss;
+    uint64_t gdt[GDT_ENTRIES];
+} __attribute__((aligned(64)));
+
+extern struct cpu cpus[NR_CPUS];
+extern unsigned int nr_cpus_online;
+
+extern const uint64_t cpu_current_offset;
+extern const uint64_t cpu_tss_rsp0_offset;
+
+static inline struct cpu *this_cpu(void) {
+    struct cpu *c;
+    __asm__ volatile ("mov %%gs:0, %0" : "=r"(c));
+    return c;
+}
+
+static inline unsigned int smp_processor_id(void) {
+    unsigned int id;
+    __asm__ volatile ("movl %%gs:%c1, %0" : "=r"(id) : "i"(__builtin_offsetof(struct cpu, id)));
+    return id;
+}
+
+void smp_early_init(void);
+void smp_init(void);
+void smp_send_resched(unsigned int cpu);
+
+#endif
@@ -0,0 +1,82 @@
+# AP的启动代码
+# BSP把ap_trampoline_start ~ ap_trampoline_end拷贝到物理地址AP_TRAMPOLINE（低于1MB，4K对齐），
+# 填好cr3和gdtr后广播INIT-SIPI-SIPI。AP从实模式直接进入长模式，再跳到高地址的ap_start64
+
+.set AP_TRAMPOLINE, 0x8000
+
+.section .text
+.code16
+.global ap_trampoline_start
+ap_trampoline_start:
+        cli
+        cld
+        xorw %ax, %ax
+        movw %ax, %ds
+
+        # PAE，页表与BSP共用
+        movl %cr4, %eax
+        orl $0b100000, %eax
+        movl %eax, %cr4
+        movl (ap_trampoline_cr3 - ap_trampoline_start + AP_TRAMPOLINE), %eax
+        movl %eax, %cr3
+
+        # EFER.LME
+        movl $0xC0000080, %ecx
+        rdmsr
+        orl $0x100, %eax
+        wrmsr
+
+        lgdtl (ap_trampoline_gdtr - ap_trampoline_start + AP_TRAMPOLINE)
+
+        # 同时打开PE和PG，直接从实模式进入长模式
+        movl %cr0, %eax
+        orl $0x80000001, %eax
+        movl %eax, %cr0
+
+        ljmpl $0x08, $(ap_trampoline_long - ap_trampoline_start + AP_TRAMPOLINE)
+
+.code64
+ap_trampoline_long:
+        mov $0x10, %eax
+        mov %eax, %ds
+        mov %eax, %es
+        mov %eax, %fs
+        mov %eax, %gs
+        mov %eax, %ss
+
+        movabs $ap_start64, %rax
+        jmp *%rax
+
+.align 8
+.global ap_trampoline_cr3
+ap_trampoline_cr3:
+        .long 0
+.global ap_trampoline_gdtr
+ap_trampoline_gdtr:
+        .word 0                            # limit
+        .long 0                            # base
+.global ap_trampoline_end
+ap_trampoline_end:
+
+# 所有AP同时启动，按到达顺序取得序号，用BSP为这个序号准备的栈
+ap_start64:
+        mov $1, %eax
+        movabs $ap_boot_count, %rbx
+        lock xaddl %eax, (%rbx)
+        movabs $ap_boot_slots, %rbx
+        cmpl (%rbx), %eax
+        jae .ap_park
+        movabs $ap_boot_stacks, %rbx
+        mov (%rbx, %rax, 8), %rsp
+        test %rsp, %rsp
+        jz .ap_park
+
+        mov %rax, %rdi
+        movabs $ap_main, %rax
+        call *%rax
+
+        # 超出NR_CPUS或来得太晚的AP停在这里
+.ap_park:
+        cli
+        hlt
+        jmp .ap_park
@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <kernel/timer.h>
+#include <kernel/cmdline.h>
+#include <kernel/string.h>
+#include <kernel/printk.h>
+#include "../cpu/cpu.h"
+
+#define CALIBRATE_US                10000
+#define CALIBRATE_ROUNDS                3
+#define NSEC_PER_MSEC             1000000UL
+#define CLOCK_SHIFT                    32
+#define CLOCK_NAME_MAX                  8
+
+#define CPUID_EXT_MAX          0x80000000
+#define CPUID_EXT_POWER        0x80000007
+#define CPUID_80000007_EDX_INVARIANT_TSC  (1 << 8)
+
+/*
+ * 单调的纳秒时钟。TSC不随频率变化、深度睡眠时也不停（invariant TSC）时用它，
+ * 否则退回PIT的tick计数，只有tick的精度。命令行clocksource=tsc|pit可以强制选择。
+ * 认为各CPU的TSC在复位后是同步的。
+ */
+
+static int clock_use_tsc = 0;
+static unsigned long tsc_khz = 0;
+static unsigned long tsc_mult = 0;          /* ns = cycles * tsc_mult >> CLOCK_SHIFT */
+static unsigned long tsc_base = 0;
+static unsigned long ns_base = 0;           /* 换到TSC时PIT时钟的读数，两个时钟在这一点接上 */
+
+static int tsc_invariant(void) {
+    unsigned int a, b, c, d;
+    cpuid(CPUID_EXT_MAX, 0, &a, &b, &c, &d);
+    if (a < CPUID_EXT_POWER)
+        return 0;
+    cpuid(CPUID_EXT_POWER, 0, &a, &b, &c, &d);
+    return (d & CPUID_80000007_EDX_INVARIANT_TSC) != 0;
+}
+
+/* 用PIT通道2量几次CALIBRATE_US内的TSC周期数，取最小的一次：被SMI等打断只会让它变多 */
+static unsigned long tsc_calibrate(void) {
+    unsigned long best = ~0UL;
+    for (unsigned int i = 0; i < CALIBRATE_ROUNDS; ++i) {
+        unsigned long flags = irq_save();
+        unsigned long start = rdtsc();
+        pit_delay(CALIBRATE_US);
+        unsigned long cycles = rdtsc() - start;
+        irq_restore(flags);
+        if (cycles < best)
+            best = cycles;
+    }
+    return best * 1000 / CALIBRATE_US;
+}
+
+static inline unsigned long tsc_to_ns(unsigned long cycles) {
+    return (unsigned long)(((unsigned __int128)cycles * tsc_mult) >> CLOCK_SHIFT);
+}
+
+/* kernel_main中timer_init之后调用，此前clock_ns按PIT计时 */
+void clock_init(void) {
+    char name[CLOCK_NAME_MAX];
+    int forced = cmdline_get("clocksource", name, sizeof(name));
+    int use_tsc = tsc_invariant();
+
+    tsc_khz = tsc_calibrate();
+    if (tsc_khz)
+        tsc_mult = (NSEC_PER_MSEC << CLOCK_SHIFT) / tsc_khz;
+    if (forced == 3 && memcmp(name, "tsc", 3) == 0)
+        use_tsc = 1;
+    else if (forced == 3 && memcmp(name, "pit", 3) == 0)
+        use_tsc = 0;
+    if (!tsc_khz)
+        use_tsc = 0;
+
+    if (use_tsc) {
+        unsigned long flags = irq_save();
+        ns_base = get_timer_count() * NSEC_PER_TICK;
+        tsc_base = rdtsc();
+        clock_use_tsc = 1;
+        irq_restore(flags);
+    }
+    printk("clock: %s, tsc %u khz%s\n", clock_name(), tsc_khz, tsc_invariant() ? " invariant" : "");
+}
+
+/* 启动以来的纳秒数；别的CPU上的TSC稍慢于tsc_base时按0算，保证不回退到ns_base之前 */
+unsigned long clock_ns(void) {
+    if (!clock_use_tsc)
+        return get_timer_count() * NSEC_PER_TICK;
+    long cycles = (long)(rdtsc() - tsc_base);
+    return ns_base + (cycles > 0 ? tsc_to_ns(cycles) : 0);
+}
+
+/* TSC的频率，没有校准时为0 */
+unsigned long clock_tsc_khz(void) {
+    return tsc_khz;
+}
+
+const char *clock_name(void) {
+    return clock_use_tsc ? "tsc" : "pit";
+}
+
+/* 忙等ns纳秒，不依赖中断；没有用TSC时按PIT的精度（微秒）向上取整 */
+void clock_delay_ns(unsigned long ns) {
+    if (!clock_use_tsc) {
+        pit_delay((ns + 999) / 1000);
+        return;
+    }
+    unsigned long start = clock_ns();
+    while (clock_ns() - start < ns)
+        cpu_relax();
+}
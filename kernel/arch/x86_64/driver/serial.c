@@ -0,0 +1,51 @@
+#include <kernel/io.h>
+#include <kernel/serial.h>
+
+#define COM1                    0x3f8
+#define COM_DATA                (COM1 + 0)
+#define COM_INT_ENABLE          (COM1 + 1)
+#define COM_DIVISOR_LOW         (COM1 + 0)      /* DLAB=1时 */
+#define COM_DIVISOR_HIGH        (COM1 + 1)
+#define COM_FIFO_CTRL           (COM1 + 2)
+#define COM_LINE_CTRL           (COM1 + 3)
+#define COM_MODEM_CTRL          (COM1 + 4)
+#define COM_LINE_STATUS         (COM1 + 5)
+
+#define LCR_DLAB                0x80
+#define LCR_8N1                 0x03
+#define LSR_THR_EMPTY           0x20
+#define SERIAL_PROBE_BYTE       0xae
+#define SERIAL_TX_SPIN          100000          /* 发送缓冲一直不空时放弃，不让没有接串口的机器卡住 */
+
+static int serial_ready = 0;
+
+/* 先用回环模式自检，没有串口时不启用 */
+void serial_init(void) {
+    outb(COM_INT_ENABLE, 0x00);
+    outb(COM_LINE_CTRL, LCR_DLAB);
+    outb(COM_DIVISOR_LOW, 1);                   /* 115200 / 1 */
+    outb(COM_DIVISOR_HIGH, 0);
+    outb(COM_LINE_CTRL, LCR_8N1);
+    outb(COM_FIFO_CTRL, 0xc7);                  /* 打开并清空FIFO，14字节触发 */
+    outb(COM_MODEM_CTRL, 0x1e);                 /* 回环 */
+    outb(COM_DATA, SERIAL_PROBE_BYTE);
+    if (inb(COM_DATA) != SERIAL_PROBE_BYTE)
+        return;
+    outb(COM_MODEM_CTRL, 0x0f);                 /* 正常模式，DTR RTS OUT1 OUT2 */
+    serial_ready = 1;
+}
+
+int serial_enabled(void) {
+    return serial_ready;
+}
+
+void serial_putchar(char c) {
+    if (!serial_ready)
+        return;
+    if (c == '\n')
+        serial_putchar('\r');
+    for (unsigned int i = 0; i < SERIAL_TX_SPIN; ++i)
+        if (inb(COM_LINE_STATUS) & LSR_THR_EMPTY)
+            break;
+    outb(COM_DATA, c);
+}
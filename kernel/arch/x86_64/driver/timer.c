@@ -1,31 +1,267 @@
 #include <stdint.h>
 #include <kernel/pic.h>
 #include <kernel/io.h>
+#include <kernel/timer.h>
 #include "../sched/task.h"
+#include "../cpu/smp.h"
+#include "../cpu/apic.h"
 
 #define PIT_IRQ_NUMBER        0x0
 #define PIT_IRQ_VECTOR       0x20
+#define PIT_FREQ          1193180
+#define PIT_COUNT_PER_TICK   (PIT_FREQ / TIMER_HZ)
+#define PIT_MAX_ONESHOT_TICKS (0xffff / PIT_COUNT_PER_TICK)  /* 16位计数器，单次最多约54ms */
 
 volatile unsigned long timer_count = 0;
 
-void timer_handler(void) {
-    PIC_sendEOI(PIT_IRQ_NUMBER);
-    timer_count++;
-    task_hook_in_timer_handler();
+/* tickless: 只有一个可运行的任务（或只有idle）时，PIT改为单次模式，在下一个定时器到期时才中断 */
+static int tick_oneshot = 0;
+static unsigned long oneshot_ticks = 0;
+static unsigned long tick_residue = 0;     /* 提前唤醒时不足一个tick的计数，留到下次 */
+
+/* 所有启动了的ktimer，堆顶为最早到期的 */
+static struct heap ktimer_heap;
+static unsigned int nr_ktimers = 0;        /* 已初始化的ktimer数，堆的容量不小于它，中断中启动定时器时不需要扩容 */
+static struct ktimer *ktimer_running = NULL;   /* ktimer_run正在执行回调的定时器 */
+
+/* 保护ktimer堆和上面的tick状态。在lock_scheduler和队列锁之后取，持有它时不再取它们，到期回调在锁外执行 */
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+static int ktimer_less(const struct heap_node *a, const struct heap_node *b) {
+    const struct ktimer *ta = container_of(a, struct ktimer, node);
+    const struct ktimer *tb = container_of(b, struct ktimer, node);
+    return (long)(ta->expires - tb->expires) < 0;
 }
 
-void timer_init(void) {
-    unsigned long divisor = 1193180 / 1000;
+static void pit_program(unsigned char mode, unsigned long divisor) {
     unsigned char l = (unsigned char)(divisor & 0xff);
     unsigned char h = (unsigned char)((divisor >> 8) & 0xff);
 
     /* init pit, ref: https://wiki.osdev.org/Programmable_Interval_Timer*/
-    outb(0x43, 0x36);    /* rate generator; libyte/hibyte; channel 0 */
+    outb(0x43, mode);
     outb(0x40, l);
     outb(0x40, h);
 }
 
+/* 单次模式下已经过去的计数 */
+static unsigned long pit_oneshot_elapsed(void) {
+    outb(0x43, 0x00);    /* latch channel 0 */
+    unsigned long remaining = inb(0x40);
+    remaining |= (unsigned long)inb(0x40) << 8;
+    unsigned long total = oneshot_ticks * PIT_COUNT_PER_TICK;
+    /* 已经数到0而中断还没处理时计数器会回绕，按整段计算 */
+    return remaining <= total ? total - remaining : total;
+}
+
+/* 提前唤醒时把单次模式下经过的时间补进timer_count，然后回到周期模式；调用者持有timer_lock */
+static void tick_resync(void) {
+    if (!tick_oneshot)
+        return;
+    unsigned long elapsed = pit_oneshot_elapsed() + tick_residue;
+    timer_count += elapsed / PIT_COUNT_PER_TICK;
+    tick_residue = elapsed % PIT_COUNT_PER_TICK;
+    tick_oneshot = 0;
+}
+
+void timer_handler(void) {
+    PIC_sendEOI(PIT_IRQ_NUMBER);
+    task_hook_in_timer_handler();
+}
+
+/* BSP的时钟中断中调用，不持有调度器的锁：推进timer_count并处理到期的定时器 */
+void timer_tick(void) {
+    spin_lock(&timer_lock);
+    if (tick_oneshot) {
+        timer_count += oneshot_ticks;
+        tick_oneshot = 0;
+        pit_program(0x36, PIT_COUNT_PER_TICK);
+    } else {
+        timer_count++;
+    }
+    spin_unlock(&timer_lock);
+    ktimer_run();
+}
+
+void timer_init(void) {
+    tick_oneshot = 0;
+    pit_program(0x36, PIT_COUNT_PER_TICK);    /* rate generator; libyte/hibyte; channel 0 */
+}
+
+/* 忙等us微秒，用PIT通道2的单次计数，不依赖中断 */
+void pit_delay(unsigned long us) {
+    while (us > 0) {
+        unsigned long chunk = us > 50000 ? 50000 : us;
+        unsigned long count = PIT_FREQ * chunk / 1000000;
+        us -= chunk;
+        if (count == 0)
+            count = 1;
+
+        unsigned char gate = (inb(0x61) & ~0x02) | 0x01;    /* 关扬声器，开通道2的gate */
+        outb(0x61, gate & ~0x01);
+        outb(0x43, 0xB0);                                    /* channel 2; lobyte/hibyte; interrupt on terminal count */
+        outb(0x42, (unsigned char)(count & 0xff));
+        outb(0x42, (unsigned char)((count >> 8) & 0xff));
+        outb(0x61, gate);                                    /* gate上升沿开始计数 */
+        while (!(inb(0x61) & 0x20))                          /* OUT2在计数到0时变高 */
+            ;
+    }
+}
+
+/* 恢复本CPU的周期tick，调用者需关中断 */
+void timer_tick_start(void) {
+    if (smp_processor_id() != 0) {
+        struct cpu *c = this_cpu();
+        if (c->tick_stopped) {
+            c->tick_stopped = 0;
+            lapic_timer_set_masked(0);
+        }
+        return;
+    }
+    /* 只有BSP会从周期模式改为单次模式，这里读到0就不会变 */
+    if (!tick_oneshot)
+        return;
+    spin_lock(&timer_lock);
+    if (tick_oneshot) {
+        tick_resync();
+        pit_program(0x36, PIT_COUNT_PER_TICK);
+    }
+    spin_unlock(&timer_lock);
+}
+
+/* PIT改为单次模式，到deadline（绝对tick）时再中断一次；可以在任意CPU上持timer_lock调用 */
+static void pit_tick_stop(unsigned long deadline) {
+    tick_resync();
+    unsigned long ticks = (deadline == KTIMER_NONE) ? PIT_MAX_ONESHOT_TICKS : deadline - timer_count;
+    if ((long)ticks <= 1) {
+        pit_program(0x36, PIT_COUNT_PER_TICK);
+        return;
+    }
+    if (ticks > PIT_MAX_ONESHOT_TICKS)
+        ticks = PIT_MAX_ONESHOT_TICKS;
+    oneshot_ticks = ticks;
+    tick_oneshot = 1;
+    pit_program(0x30, ticks * PIT_COUNT_PER_TICK);    /* interrupt on terminal count; lobyte/hibyte; channel 0 */
+}
+
+static unsigned long ktimer_deadline_locked(void) {
+    struct heap_node *top = heap_top(&ktimer_heap);
+    if (!top)
+        return KTIMER_NONE;
+    struct ktimer *timer = container_of(top, struct ktimer, node);
+    return timer->expires;
+}
+
+/* 停掉本CPU的周期tick；调用者需关中断 */
+/* 定时器都在BSP上处理，AP停掉tick后只由IPI唤醒 */
+void timer_tick_stop(unsigned long deadline) {
+    if (smp_processor_id() != 0) {
+        this_cpu()->tick_stopped = 1;
+        lapic_timer_set_masked(1);
+        return;
+    }
+    spin_lock(&timer_lock);
+    /* 调用者取deadline之后别的CPU可能又启动了更早到期的定时器 */
+    unsigned long next = ktimer_deadline_locked();
+    if (deadline == KTIMER_NONE || (next != KTIMER_NONE && (long)(next - deadline) < 0))
+        deadline = next;
+    pit_tick_stop(deadline);
+    spin_unlock(&timer_lock);
+}
+
+/* 单次模式下要锁存PIT的计数，几个CPU同时读会读乱 */
 unsigned long get_timer_count() {
-    return timer_count;
+    if (!__atomic_load_n(&tick_oneshot, __ATOMIC_ACQUIRE))
+        return timer_count;
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    unsigned long count = timer_count;
+    if (tick_oneshot)
+        count += (pit_oneshot_elapsed() + tick_residue) / PIT_COUNT_PER_TICK;
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return count;
+}
+
+
+/* 会扩容定时器堆，只能在进程上下文中调用 */
+int ktimer_init(struct ktimer *timer, void (*func)(struct ktimer *timer, void *data), void *data) {
+    int ret = 0;
+    heap_node_init(&timer->node);
+    timer->expires = 0;
+    timer->period = 0;
+    timer->func = func;
+    timer->data = data;
+
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    if (!ktimer_heap.less)
+        ret = heap_init(&ktimer_heap, nr_ktimers + 1, ktimer_less);
+    else
+        ret = heap_reserve(&ktimer_heap, nr_ktimers + 1);
+    if (ret == 0)
+        nr_ktimers++;
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return ret;
+}
+
+/* 回调可能正在BSP上执行，等它返回后才能释放定时器；不能在持有lock_scheduler时调用，回调可能在等这把锁 */
+void ktimer_destroy(struct ktimer *timer) {
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    if (heap_queued(&timer->node))
+        heap_remove(&ktimer_heap, &timer->node);
+    nr_ktimers--;
+    spin_unlock_irqrestore(&timer_lock, flags);
+    while (__atomic_load_n(&ktimer_running, __ATOMIC_ACQUIRE) == timer)
+        cpu_relax();
+}
+
+/* expires为绝对的tick；已启动的定时器会被重新设置 */
+void ktimer_start(struct ktimer *timer, unsigned long expires, unsigned long period) {
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    timer->expires = expires;
+    timer->period = period;
+    if (heap_queued(&timer->node))
+        heap_update(&ktimer_heap, &timer->node);
+    else
+        heap_push(&ktimer_heap, &timer->node);
+    /* tick已停且新的定时器比单次中断更早到期 */
+    if (tick_oneshot && (long)(expires - (timer_count + oneshot_ticks)) < 0)
+        pit_tick_stop(expires);
+    spin_unlock_irqrestore(&timer_lock, flags);
 }
 
+void ktimer_cancel(struct ktimer *timer) {
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    if (heap_queued(&timer->node))
+        heap_remove(&ktimer_heap, &timer->node);
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+/* 最早的到期时间，没有定时器时返回KTIMER_NONE */
+unsigned long ktimer_next_deadline(void) {
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    unsigned long deadline = ktimer_deadline_locked();
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return deadline;
+}
+
+/* timer_tick中调用，只处理已到期的定时器；周期定时器先重新放回堆中，回调中可以取消它。
+   回调在timer_lock之外执行，可以取lock_scheduler、启动或取消定时器 */
+void ktimer_run(void) {
+    for (;;) {
+        spin_lock(&timer_lock);
+        struct heap_node *top = heap_top(&ktimer_heap);
+        struct ktimer *timer = top ? container_of(top, struct ktimer, node) : NULL;
+        if (!timer || (long)(timer->expires - timer_count) > 0) {
+            spin_unlock(&timer_lock);
+            break;
+        }
+        if (timer->period) {
+            timer->expires += timer->period;
+            heap_update(&ktimer_heap, top);
+        } else {
+            heap_remove(&ktimer_heap, top);
+        }
+        __atomic_store_n(&ktimer_running, timer, __ATOMIC_RELAXED);
+        spin_unlock(&timer_lock);
+        timer->func(timer, timer->data);
+        __atomic_store_n(&ktimer_running, NULL, __ATOMIC_RELEASE);
+    }
+}
@@ -5,7 +5,8 @@
 #include <kernel/idt.h>
 #include <kernel/printk.h>
 #include <kernel/tty.h>
-#include "../sched/task.h"
+#include <kernel/serial.h>
+#include <kernel/spinlock.h>
 
 #define EOF (-1)
 #define UINT_MAX    0xffffffffffffffff
@@ -75,6 +76,7 @@ static char* itoa_unsigned(unsigned long value, char* str, int base) {
 
 static int putchar(char c) {
     terminal_putchar(c);
+    serial_putchar(c);
     return 0;
 }
 
@@ -142,11 +144,12 @@ int vprintk_func(const char *format, va_list parameters) {
                 return -1;
             written += len;
         } else if (*format == 'u' || *format == 'x') {
+            int base = (*format == 'u') ? 10 : 16;
             format++;
             char str[32];
             memset(str, 0, 32);
             unsigned long num = (unsigned long) va_arg(parameters, unsigned long);
-            itoa_unsigned(num, str, (*format == 'u') ? 10 : 16);
+            itoa_unsigned(num, str, base);
             size_t len = strlen(str);
             if (!print(str, strlen(str)))
                 return -1;
@@ -167,13 +170,16 @@ int vprintk_func(const char *format, va_list parameters) {
     return written;
 }
 
+/* 排号锁，多个CPU同时打印时按先后顺序整行输出；中断中也会打印，要关中断取锁 */
+static ticket_lock_t printk_lock = TICKET_LOCK_INIT;
+
 int printk(const char*restrict format, ...) {
-    lock_scheduler();
+    unsigned long flags = ticket_lock_irqsave(&printk_lock);
     int r;
     va_list parameters;
     va_start(parameters, format);
     r = vprintk_func(format, parameters);
     va_end(parameters);
-    unlock_scheduler();
+    ticket_unlock_irqrestore(&printk_lock, flags);
     return r;
 }
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include <kernel/heap.h>
+#include <kernel/malloc.h>
+
+static void heap_set(struct heap *h, unsigned int i, struct heap_node *node) {
+    h->nodes[i] = node;
+    node->index = i;
+}
+
+static void heap_sift_up(struct heap *h, unsigned int i) {
+    struct heap_node *node = h->nodes[i];
+    while (i > 0) {
+        unsigned int parent = (i - 1) / 2;
+        if (!h->less(node, h->nodes[parent]))
+            break;
+        heap_set(h, i, h->nodes[parent]);
+        i = parent;
+    }
+    heap_set(h, i, node);
+}
+
+static void heap_sift_down(struct heap *h, unsigned int i) {
+    struct heap_node *node = h->nodes[i];
+    for (;;) {
+        unsigned int child = 2 * i + 1;
+        if (child >= h->size)
+            break;
+        if (child + 1 < h->size && h->less(h->nodes[child + 1], h->nodes[child]))
+            ++child;
+        if (!h->less(h->nodes[child], node))
+            break;
+        heap_set(h, i, h->nodes[child]);
+        i = child;
+    }
+    heap_set(h, i, node);
+}
+
+int heap_init(struct heap *h, unsigned int capacity,
+              int (*less)(const struct heap_node *a, const struct heap_node *b)) {
+    h->size = 0;
+    h->capacity = 0;
+    h->nodes = NULL;
+    h->less = less;
+    return heap_reserve(h, capacity);
+}
+
+/* 扩容会调用krealloc，只能在进程上下文中调用；中断里push的堆要预先留够空间 */
+int heap_reserve(struct heap *h, unsigned int capacity) {
+    if (capacity <= h->capacity)
+        return 0;
+    if (capacity < 2 * h->capacity)
+        capacity = 2 * h->capacity;
+
+    struct heap_node **nodes = krealloc(h->nodes, capacity * sizeof(struct heap_node *));
+    if (!nodes)
+        return -1;
+    h->nodes = nodes;
+    h->capacity = capacity;
+    return 0;
+}
+
+/* 堆满时返回-1，不会扩容 */
+int heap_push(struct heap *h, struct heap_node *node) {
+    if (h->size == h->capacity)
+        return -1;
+    heap_set(h, h->size++, node);
+    heap_sift_up(h, node->index);
+    return 0;
+}
+
+struct heap_node *heap_pop(struct heap *h) {
+    struct heap_node *top = heap_top(h);
+    if (top)
+        heap_remove(h, top);
+    return top;
+}
+
+void heap_remove(struct heap *h, struct heap_node *node) {
+    unsigned int i = node->index;
+    struct heap_node *last = h->nodes[--h->size];
+
+    node->index = HEAP_NOT_QUEUED;
+    if (last == node)
+        return;
+    heap_set(h, i, last);
+    heap_update(h, last);
+}
+
+/* 节点的key改变之后调用 */
+void heap_update(struct heap *h, struct heap_node *node) {
+    unsigned int i = node->index;
+    if (i > 0 && h->less(node, h->nodes[(i - 1) / 2]))
+        heap_sift_up(h, i);
+    else
+        heap_sift_down(h, i);
+}
@@ -0,0 +1,150 @@
+#include "bitmap.h"
+
+/* tzcnt 在不支持BMI1的CPU上会按 bsf 执行，输入非0时两者结果相同 */
+static inline uint64_t tzcnt64(uint64_t x) {
+    uint64_t r;
+    __asm__ ("tzcnt %1, %0" : "=r"(r) : "rm"(x) : "cc");
+    return r;
+}
+
+/* lzcnt 在不支持的CPU上会被当作 bsr，结果不同，所以交给编译器生成 bsr 版本，输入必须非0 */
+static inline uint64_t lzcnt64(uint64_t x) {
+    return __builtin_clzll(x);
+}
+
+/* 从 start 位开始的掩码，共 count 位，不跨字 */
+static inline uint64_t word_mask(uint64_t start, uint64_t count) {
+    if (count >= BITMAP_WORD_BITS)
+        return BITMAP_FULL_WORD;
+    return (((uint64_t)1 << count) - 1) << start;
+}
+
+int bitmap_test(const uint64_t *map, uint64_t index) {
+    return (map[index / BITMAP_WORD_BITS] >> (index % BITMAP_WORD_BITS)) & 1;
+}
+
+void bitmap_set_range(uint64_t *map, uint64_t start, uint64_t count) {
+    uint64_t *p = map + start / BITMAP_WORD_BITS;
+    uint64_t offset = start % BITMAP_WORD_BITS;
+
+    if (count == 0)
+        return;
+    /* 首字只覆盖部分位 */
+    if (offset + count <= BITMAP_WORD_BITS) {
+        *p |= word_mask(offset, count);
+        return;
+    }
+    *p++ |= word_mask(offset, BITMAP_WORD_BITS - offset);
+    count -= BITMAP_WORD_BITS - offset;
+    /* 中间整字直接写 */
+    while (count >= BITMAP_WORD_BITS) {
+        *p++ = BITMAP_FULL_WORD;
+        count -= BITMAP_WORD_BITS;
+    }
+    if (count)
+        *p |= word_mask(0, count);
+}
+
+void bitmap_clear_range(uint64_t *map, uint64_t start, uint64_t count) {
+    uint64_t *p = map + start / BITMAP_WORD_BITS;
+    uint64_t offset = start % BITMAP_WORD_BITS;
+
+    if (count == 0)
+        return;
+    if (offset + count <= BITMAP_WORD_BITS) {
+        *p &= ~word_mask(offset, count);
+        return;
+    }
+    *p++ &= ~word_mask(offset, BITMAP_WORD_BITS - offset);
+    count -= BITMAP_WORD_BITS - offset;
+    while (count >= BITMAP_WORD_BITS) {
+        *p++ = 0;
+        count -= BITMAP_WORD_BITS;
+    }
+    if (count)
+        *p &= ~word_mask(0, count);
+}
+
+/* 在 [from, nbits) 中查找 count 个连续的0位，返回起始位置，找不到返回-1 */
+int64_t bitmap_find_free_run(const uint64_t *map, uint64_t nbits, uint64_t from, uint64_t count) {
+    uint64_t nwords = BITMAP_WORDS(nbits);
+    uint64_t run_start = 0, run_len = 0;
+
+    if (count == 0 || from + count > nbits)
+        return -1;
+
+    for (uint64_t w = from / BITMAP_WORD_BITS; w < nwords; ++w) {
+        uint64_t word = map[w];
+        uint64_t base = w * BITMAP_WORD_BITS;
+
+        /* 第一个字中 from 之前的位当作已占用 */
+        if (base < from)
+            word |= word_mask(0, from - base);
+
+        /* 整字已满，直接跳过 */
+        if (word == BITMAP_FULL_WORD) {
+            run_len = 0;
+            continue;
+        }
+
+        /* 整字空闲，区间延长64位 */
+        if (word == 0) {
+            if (run_len == 0)
+                run_start = base;
+            run_len += BITMAP_WORD_BITS;
+            if (run_len >= count)
+                break;
+            continue;
+        }
+
+        /* 单页：第一个0位就是结果 */
+        if (count == 1) {
+            run_start = base + tzcnt64(~word);
+            run_len = 1;
+            break;
+        }
+
+        /* 跨字的区间只可能接上本字的低位空闲部分，并从本字的高位空闲部分开始 */
+        uint64_t low_free = tzcnt64(word);
+        if (run_len == 0)
+            run_start = base;
+        if (run_len + low_free >= count) {
+            run_len += low_free;
+            break;
+        }
+        if (count > BITMAP_WORD_BITS) {
+            run_len = lzcnt64(word);
+            run_start = base + BITMAP_WORD_BITS - run_len;
+            continue;
+        }
+
+        /* count <= 64，区间可能在字内，用tzcnt逐段跳过占用位和空闲位 */
+        uint64_t bit = low_free;
+        run_len = 0;
+        while (bit < BITMAP_WORD_BITS) {
+            uint64_t used = ~word >> bit;
+            if (used == 0)
+                break;                                      /* 剩下都是占用位 */
+            bit += tzcnt64(used);
+            uint64_t rest = word >> bit;
+            if (rest == 0) {                                /* 剩下都是空闲位，留给下一个字接上 */
+                run_start = base + bit;
+                run_len = BITMAP_WORD_BITS - bit;
+                break;
+            }
+            uint64_t free_bits = tzcnt64(rest);
+            if (free_bits >= count) {
+                run_start = base + bit;
+                run_len = free_bits;
+                break;
+            }
+            bit += free_bits;
+        }
+        if (run_len >= count)
+            break;
+    }
+
+    if (run_len < count || run_start + count > nbits)
+        return -1;
+    return run_start;
+}
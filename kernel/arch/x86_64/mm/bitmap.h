@@ -0,0 +1,17 @@
+#ifndef _BITMAP_H
+#define _BITMAP_H
+
+#include <stdint.h>
+
+#define BITMAP_WORD_BITS          64
+#define BITMAP_FULL_WORD          (~(uint64_t)0)
+
+/* 对应的 bitmap 需要的 uint64_t 个数 */
+#define BITMAP_WORDS(nbits)       (((nbits) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+int bitmap_test(const uint64_t *map, uint64_t index);
+void bitmap_set_range(uint64_t *map, uint64_t start, uint64_t count);
+void bitmap_clear_range(uint64_t *map, uint64_t start, uint64_t count);
+int64_t bitmap_find_free_run(const uint64_t *map, uint64_t nbits, uint64_t from, uint64_t count);
+
+#endif
@@ -3,32 +3,71 @@
 #include <kernel/tty.h>
 #include <kernel/page.h>
 #include <kernel/printk.h>
+#include <kernel/string.h>
+#include <kernel/timer.h>
+#include <kernel/spinlock.h>
 #include "pagemanager.h"
 #include "../sched/task.h"
+#include "../cpu/smp.h"
 
 #define HEADER_SIZE       ((size_t)&((chunk*)0)->data)
 #define MM_PAGE_NUM                               1024
 
-#define is_last_entry(h) ((h)->next==(h))
+/* magazine: 每个CPU为常用大小缓存少量对象，快速路径不需要kmalloc_lock，只关本CPU的中断 */
+#define MAG_MIN_SHIFT                                4      /* 最小的class为16字节 */
+#define MAG_CLASSES                                  6      /* 16, 32, 64, 128, 256, 512 */
+#define MAG_ROUNDS                                  16      /* 每个magazine最多缓存的对象数 */
+#define MAG_BATCH                       (MAG_ROUNDS / 2)    /* 每次与主堆交换的对象数 */
+
+/* 超过KMALLOC_LARGE的请求直接从页分配器分配，不经过chunk堆 */
+#define KMALLOC_LARGE                    (2 * PAGE_SIZE)
+#define LARGE_SHIFT                                  9
+#define LARGE_SLOTS                  (1 << LARGE_SHIFT)     /* 大块表的槽数，必须是2的幂 */
 
 typedef struct {
     struct page_alloc pa;
     size_t mem_free;
     size_t mem_used;
     size_t mem_meta;
+    unsigned int nr_used;                                   /* 已分配的chunk数，为0时整页归还 */
     chunk *first, *last;
-    chunk *free_chunk[NUM_SIZES];
-    struct list_head *prev, *next;
 } page_tag;
 
 page_tag mm_pages[MM_PAGE_NUM] = { NULL };
-int cur_page_tag_index = -1;
+
+/* 所有页共用的空闲chunk链表，按chunk大小的log2分组；free_bin_map记录哪些bin非空 */
+static struct list_head free_bins[NUM_SIZES];
+static uint32_t free_bin_map = 0;
+
+/* 空闲的page_tag下标栈，申请新页时O(1)取得 */
+static unsigned int free_tags[MM_PAGE_NUM];
+static unsigned int free_tag_count = 0;
+static int kmemory_ready = 0;
+
+/* 保护chunk堆、bin和大块表；kfree可能在中断中调用，要关中断取锁 */
+static spinlock_t kmalloc_lock = SPINLOCK_INIT;
+
+struct magazine {
+    unsigned int rounds;
+    void *objs[MAG_ROUNDS];
+};
+
+struct kmalloc_cpu_cache {
+    struct magazine mags[MAG_CLASSES];
+    unsigned long nr_alloc, nr_free;
+};
+
+static struct kmalloc_cpu_cache cpu_caches[NR_CPUS];
+
+/* 大块表：以页地址为key的开放寻址哈希表，线性探测，page为0表示空槽 */
+static struct page_alloc large_table[LARGE_SLOTS];
+static unsigned int large_count = 0;
 
 /* 初始化一个chunk */
-static void memory_chunk_init(chunk *ck) {
+static void memory_chunk_init(chunk *ck, unsigned int page_tag_index) {
     INIT_LIST_HEAD(&ck->all);
     ck->used = 0;
-    ck->page_tag_index = cur_page_tag_index;
+    ck->page_tag_index = page_tag_index;
     INIT_LIST_HEAD(&ck->free);
 }
 
@@ -49,16 +88,71 @@ static int memory_chunk_slot(size_t size) {
     return n;
 }
 
+static void bin_insert(chunk *ck) {
+    page_tag *pt = &mm_pages[ck->page_tag_index];
+    size_t len = memory_chunk_size(ck);
+    int n = memory_chunk_slot(len);
+
+    list_add(&ck->free, &free_bins[n]);
+    free_bin_map |= (uint32_t)1 << n;
+    pt->mem_free += len - HEADER_SIZE;
+}
+
+static void bin_remove(chunk *ck) {
+    page_tag *pt = &mm_pages[ck->page_tag_index];
+    size_t len = memory_chunk_size(ck);
+    int n = memory_chunk_slot(len);
+
+    list_del(&ck->free);
+    if (list_empty(&free_bins[n]))
+        free_bin_map &= ~((uint32_t)1 << n);
+    pt->mem_free -= len - HEADER_SIZE;
+}
+
+/* 找到一个不小于need的空闲chunk */
+static chunk *bin_find(size_t need) {
+    int n = memory_chunk_slot(need);
+    if (n >= NUM_SIZES) return NULL;                                               /* 无法分配超出范围的内存 */
+
+    /* bin n 中的chunk不一定够大，只看第一个，避免遍历 */
+    if (!list_empty(&free_bins[n])) {
+        chunk *ck = container_of(free_bins[n].next, chunk, free);
+        if (memory_chunk_size(ck) >= need)
+            return ck;
+    }
+    /* 更高的bin中任意chunk都足够大 */
+    uint32_t map = (n + 1 < NUM_SIZES) ? free_bin_map & ~(((uint32_t)2 << n) - 1) : 0;
+    if (!map) return NULL;
+    n = __builtin_ctz(map);
+    return container_of(free_bins[n].next, chunk, free);
+}
+
 void kmemory_init() {
+    if (kmemory_ready) return;
+
     for (unsigned int i = 0; i < MM_PAGE_NUM * sizeof(page_tag); ++i) {
         *((char*)mm_pages + i) = 0;
     }
+    for (unsigned int i = 0; i < NUM_SIZES; ++i)
+        INIT_LIST_HEAD(&free_bins[i]);
+    free_bin_map = 0;
+    /* 下标小的先被使用 */
+    free_tag_count = 0;
+    for (unsigned int i = MM_PAGE_NUM; i > 0; --i)
+        free_tags[free_tag_count++] = i - 1;
+    kmemory_ready = 1;
 }
 
-static void kmemory_page_init(unsigned int page_tag_index) {
+/* 为size申请新页，并把整页作为一个空闲chunk放入bin */
+static int kmemory_page_add(size_t size) {
+    if (free_tag_count == 0) return -1;
+
+    struct page_alloc pa = alloc_pages((3 * sizeof(chunk) + size + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (pa.page == 0) return -1;
 
-    if (page_tag_index >= MM_PAGE_NUM) return;
+    unsigned int page_tag_index = free_tags[--free_tag_count];
     page_tag *pt = &mm_pages[page_tag_index];
+    pt->pa = pa;
 
     void *mem = pt->pa.page;
     char *mem_start = (char*)(((intptr_t)mem + ALIGN -1) & (~(ALIGN -1)));        /* 向后对齐 */
@@ -67,266 +161,636 @@ static void kmemory_page_init(unsigned int page_tag_index) {
     pt->first = (chunk*)mem_start;                                                    /* 第一个块 */
     chunk *second = pt->first + 1;
     pt->last = ((chunk*)mem_end) - 1;                                                 /* 最后一个块 */
-    memory_chunk_init(pt->first);
-    memory_chunk_init(second);
-    memory_chunk_init(pt->last);
+    memory_chunk_init(pt->first, page_tag_index);
+    memory_chunk_init(second, page_tag_index);
+    memory_chunk_init(pt->last, page_tag_index);
     list_add_tail(&second->all, &pt->first->all);
     list_add_tail(&pt->last->all, &pt->first->all);
     /* make first/last as used so they never get merged */
     pt->first->used = 1;
     pt->last->used = 1;
-    pt->first->page_tag_index = page_tag_index;
-    pt->last->page_tag_index = page_tag_index;
-    second->page_tag_index = page_tag_index;
 
-
-    size_t len = memory_chunk_size(second);
-    int n = memory_chunk_slot(len);
-    // printk("%s(%d, %d): adding chunk %d %d\n", __FUNCTION__, mem, size, len, n);
-    pt->free_chunk[n] = second;
-    pt->mem_free = len - HEADER_SIZE;                                                /* 为什么这里还要减去一个HEADER_SIZE?在memory_chunk_size已经减去一个了 */
+    pt->nr_used = 0;
+    pt->mem_free = 0;
+    pt->mem_used = 0;
     pt->mem_meta = sizeof(chunk) * 2 + HEADER_SIZE;
+    bin_insert(second);
+    return 0;
 }
 
-static void *kmalloc_on_cur_page(size_t size) {
-    if (cur_page_tag_index == -1) return NULL;
-    page_tag *cur_page_tag = &(mm_pages[cur_page_tag_index]);
-
-    size = (size + ALIGN - 1) & (~(ALIGN - 1));
+static unsigned int large_hash(const void *page) {
+    return (unsigned int)((((uintptr_t)page / PAGE_SIZE) * 0x9E3779B97F4A7C15ull) >> (64 - LARGE_SHIFT));
+}
 
-    if (size < MIN_SIZE) size = MIN_SIZE;
+/* 查找page对应的槽，不存在时返回-1 */
+static int large_lookup(const void *page) {
+    if (large_count == 0 || ((uintptr_t)page & (PAGE_SIZE - 1)))
+        return -1;
+    for (unsigned int i = large_hash(page); large_table[i].page; i = (i + 1) & (LARGE_SLOTS - 1)) {
+        if (large_table[i].page == page)
+            return i;
+    }
+    return -1;
+}
 
-    if (size > cur_page_tag->mem_free) return NULL;
+/* 调用者需持有kmalloc_lock；表满或没有页时返回NULL */
+static void *large_alloc(size_t size) {
+    if (large_count >= LARGE_SLOTS * 3 / 4)                                            /* 保持装载率，探测链不会太长 */
+        return NULL;
+
+    struct page_alloc pa = alloc_pages((size + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (pa.page == 0)
+        return NULL;
+
+    unsigned int i = large_hash(pa.page);
+    while (large_table[i].page)
+        i = (i + 1) & (LARGE_SLOTS - 1);
+    large_table[i] = pa;
+    large_count++;
+    return pa.page;
+}
 
-    int n = memory_chunk_slot(size + HEADER_SIZE);
-    if (n >= NUM_SIZES) return NULL;                                               /* 无法分配超出范围的内存 */
-    while (!cur_page_tag->free_chunk[n]) {                                                       /* 都是从free_chunk中查找的，类似glibc中的各种bin？ */
-        ++n;
-        if (n >= NUM_SIZES) return NULL;
+/* 调用者需持有kmalloc_lock；删除后把后面的项往前挪，不需要墓碑 */
+static void large_free(int slot) {
+    unsigned int i = slot, j = slot;
+
+    free_pages(&large_table[i]);
+    large_count--;
+    for (;;) {
+        large_table[i].page = 0;
+        for (;;) {
+            j = (j + 1) & (LARGE_SLOTS - 1);
+            if (large_table[j].page == 0)
+                return;
+            unsigned int h = large_hash(large_table[j].page);
+            /* h不在(i, j]之间时，j处的项可以移到i */
+            if (i <= j ? (h <= i || h > j) : (h <= i && h > j))
+                break;
+        }
+        large_table[i] = large_table[j];
+        i = j;
     }
+}
 
-    chunk *fetch_ck = cur_page_tag->free_chunk[n];
-    if (is_last_entry(&fetch_ck->free))
-        cur_page_tag->free_chunk[n] = NULL;
-    else {
-        cur_page_tag->free_chunk[n] = container_of(fetch_ck->free.next, chunk, free);
-        list_del(&fetch_ck->free);                                                  /* 从list中取出*/
-    }
-    size_t size2 = memory_chunk_size(fetch_ck);
-    size_t len = 0;
-
-    if (size + 2 * sizeof(chunk) <= size2) {      /* 注意，这里比较时要用size+2*sizeof(chunk)，因为后续的chunk包括fetch_ck和ck2的chunk */
-        chunk *ck2 = (chunk*)(((char*)fetch_ck) + HEADER_SIZE + size);             /* 此处把ck2作为切分之后余下的chunk添加到all list和free list */
-        memory_chunk_init(ck2);
-        list_add(&ck2->all, &fetch_ck->all);    /* ck2插入到fetch_ck后面 */
-        len = memory_chunk_size(ck2);
-
-        int n = memory_chunk_slot(len);
-        if (!cur_page_tag->free_chunk[n]) {
-            INIT_LIST_HEAD(&ck2->free);
-            cur_page_tag->free_chunk[n] = ck2;
-        } else
-            list_add_tail(&ck2->free, &cur_page_tag->free_chunk[n]->free);
-        cur_page_tag->mem_meta += HEADER_SIZE;                                                   /* 只有all list变化时mem_meta才会改变 */
-        cur_page_tag->mem_free += len - HEADER_SIZE;                                             /* 只有free_list变化时mem_free会发生改变 */
+/* 余下的空间还能放下一个chunk时切分，ck2作为切分之后余下的chunk与后面的空闲chunk合并后放回bin */
+static void memory_chunk_split(chunk *ck, size_t need) {
+    page_tag *pt = &mm_pages[ck->page_tag_index];
+
+    if (need + sizeof(chunk) > memory_chunk_size(ck))
+        return;
+
+    chunk *ck2 = (chunk*)(((char*)ck) + need);
+    memory_chunk_init(ck2, ck->page_tag_index);
+    list_add(&ck2->all, &ck->all);                                                     /* ck2插入到ck后面 */
+    pt->mem_meta += HEADER_SIZE;                                                       /* 只有all list变化时mem_meta才会改变 */
+
+    chunk *next = container_of(ck2->all.next, chunk, all);
+    if (next->used == 0) {
+        bin_remove(next);
+        list_del(&next->all);
+        pt->mem_meta -= HEADER_SIZE;
     }
+    bin_insert(ck2);
+}
+
+static void *kmalloc_from_bins(size_t size) {
+    size_t need = size + HEADER_SIZE;
+    chunk *fetch_ck = bin_find(need);
+    if (!fetch_ck) return NULL;
+
+    page_tag *pt = &mm_pages[fetch_ck->page_tag_index];
+    bin_remove(fetch_ck);
+    memory_chunk_split(fetch_ck, need);
 
     fetch_ck->used = 1;
-    cur_page_tag->mem_free -= (size2 - HEADER_SIZE);
-    cur_page_tag->mem_used += size2 - len - HEADER_SIZE;                                          /* 当新增used chunk时，mem_used会改变 */
+    pt->nr_used++;
+    pt->mem_used += memory_chunk_size(fetch_ck) - HEADER_SIZE;                        /* 当新增used chunk时，mem_used会改变 */
 
     return fetch_ck->data;
 }
 
-void *kmalloc(size_t size) {
-    lock_scheduler();
-    void *p = NULL;
-    if (size == 0) {
-        p = NULL;
-        goto end;
-    }
+static size_t kmalloc_round(size_t size) {
+    size = (size + ALIGN - 1) & (~(ALIGN - 1));
+    return size < MIN_SIZE ? MIN_SIZE : size;
+}
 
-    /* 首次分配需要设置当前的page_tag */
-    if (cur_page_tag_index == -1) {
-        struct page_alloc pa = alloc_pages((3 * sizeof(chunk) + size + PAGE_SIZE - 1) / PAGE_SIZE);
-        if (pa.page == 0) {
-            p = NULL;
-            goto end;
-        }
-        cur_page_tag_index = 0;
-        mm_pages[cur_page_tag_index].pa = pa;
-        kmemory_page_init(0);
-    }
+static int __kmcheck(void);
 
-    /* 在当前页分配内存 */
-    p = kmalloc_on_cur_page(size);
-
-    /* 当前页无法满足，则在列表里搜索新页 */
-    if (!p) {
-        int first_free_index = -1;  /* 记录首个空page位置，以便后续发生的page分配 */
-        for (unsigned int i = 0; i < MM_PAGE_NUM; ++i) {
-            page_tag *tmp_pt = mm_pages + i;
-            if (i == cur_page_tag_index)
-                continue;
-            if (first_free_index == -1 && tmp_pt->pa.page == 0) {
-                first_free_index = i;
-                continue;
-            }
-            if (tmp_pt->mem_free < size)
-                continue;
-            cur_page_tag_index = i;
-            p = kmalloc_on_cur_page(size);
-            if (p)
-                break;
-        }
-        /* 如果在所有已申请页还未分配内存，则申请新页 */
-        if (!p && (first_free_index != -1)) {
-            struct page_alloc pa = alloc_pages((3 * sizeof(chunk) + size + PAGE_SIZE - 1) / PAGE_SIZE);
-            if (pa.page == 0) {
-                p = NULL;
-                goto end;
-            }
-            mm_pages[first_free_index].pa = pa;
-            cur_page_tag_index = first_free_index;
-            kmemory_page_init(cur_page_tag_index);
-            p = kmalloc_on_cur_page(size);
-        }
-    }
-
-    int check = kmcheck();
-    if (check != 0) {
-        printk("check ");
-    }
+/* 调用者需持有kmalloc_lock */
+static void *__kmalloc(size_t size) {
+    void *p = NULL;
 
-end:
-    unlock_scheduler();
-    return p;
-}
+    kmemory_init();
+    size = kmalloc_round(size);
 
-static void remove_free(chunk *ck) {
-    page_tag *pt = &(mm_pages[ck->page_tag_index]);
-    size_t len = memory_chunk_size(ck);
-    int n = memory_chunk_slot(len);
-    if (is_last_entry(&(pt->free_chunk[n]->free))) {
-        if (ck == pt->free_chunk[n])
-            pt->free_chunk[n] = NULL;
-    } else {
-        pt->free_chunk[n] = container_of(ck->free.next, chunk, free);
-        list_del(&ck->free);
-    }
+    /* 所有页共用bin，直接查找 */
+    p = kmalloc_from_bins(size);
 
-    pt->mem_free -= len - HEADER_SIZE;
-}
+    /* bin中没有足够大的chunk，申请新页 */
+    if (!p && kmemory_page_add(size) == 0)
+        p = kmalloc_from_bins(size);
 
-static void push_free(chunk *ck) {
-    page_tag *pt = &(mm_pages[ck->page_tag_index]);
-    size_t len = memory_chunk_size(ck);
-    int n = memory_chunk_slot(len);
-    if (!pt->free_chunk[n]) {
-        INIT_LIST_HEAD(&ck->free);
-        pt->free_chunk[n] = ck;
-    } else {
-        list_add_tail(&ck->free, &pt->free_chunk[n]->free);
-    }
+#ifdef KMCHECK_DEBUG
+    __kmcheck();
+#endif
+    return p;
 }
 
-void kfree(void *mem) {
-    lock_scheduler();
+/* 调用者需持有kmalloc_lock */
+static void __kfree(void *mem) {
     chunk *ck = (chunk*)((char*)mem - HEADER_SIZE);
     chunk *next = container_of(ck->all.next, chunk, all);
     chunk *prev = container_of(ck->all.prev, chunk, all);
 
-
     unsigned int page_tag_index = ck->page_tag_index;
     page_tag *pt = &mm_pages[page_tag_index];
-    pt->mem_used -= memory_chunk_size(ck);
+    pt->mem_used -= memory_chunk_size(ck) - HEADER_SIZE;
+    pt->nr_used--;
+    ck->used = 0;
 
     /* try to merge */
     if (next->used == 0) {
-        remove_free(next);                                        /* 从free list移出next*/
+        bin_remove(next);                                         /* 从free list移出next*/
         list_del(&next->all);                                     /* 删除next */
         pt->mem_meta -= HEADER_SIZE;                                  /* mem_meta少了next的header大小 */
-        pt->mem_free += HEADER_SIZE;                                  /* mem_free多了next的header大小 */
     }
 
     if (prev->used == 0) {
-        remove_free(prev);                                        /* 从free list移出prev */
+        bin_remove(prev);                                         /* 从free list移出prev */
         list_del(&ck->all);                                       /* 删除当前ck，因为要和prev合并 */
-        push_free(prev);                                          /* 将新的prev放入free list */
         pt->mem_meta -= HEADER_SIZE;
-        pt->mem_free -= HEADER_SIZE;
+        ck = prev;
+    }
+
+    /* 页中已无used chunk，此时只剩下一个空闲chunk，整页归还 */
+    if (pt->nr_used == 0) {
+        free_pages(&pt->pa);
+        pt->pa.page = 0;
+        pt->pa.npages = 0;
+        pt->mem_free = 0;
+        pt->mem_meta = 0;
+        free_tags[free_tag_count++] = page_tag_index;
     } else {
-        ck->used = 0;
-        INIT_LIST_HEAD(&ck->free);
-        push_free(ck);                                             /* 将free后的ck重新放入free list */
+        bin_insert(ck);                                            /* 将合并后的ck重新放入free list */
+    }
+
+#ifdef KMCHECK_DEBUG
+    __kmcheck();
+#endif
+}
+
+/* size对应的magazine class，不在范围内返回-1 */
+static int mag_class(size_t size) {
+    int c = 0;
+    while (((size_t)1 << (c + MAG_MIN_SHIFT)) < size) {
+        if (++c >= MAG_CLASSES)
+            return -1;
     }
+    return c;
+}
 
-    /* 如果page中无其他释放page */
-    struct list_head *p = pt->first->all.next;
-    int need_free_page = 1;
-    while (p != &pt->last->all) {
-        chunk *tmp = container_of(p, chunk, all);
-        if (tmp->used) {
-            need_free_page = 0;
+/* 已分配chunk能服务的最大class；chunk未被释放时其all.next不会被其他人修改，无需加锁 */
+static int mag_chunk_class(void *mem) {
+    chunk *ck = (chunk*)((char*)mem - HEADER_SIZE);
+    size_t usable = memory_chunk_size(ck) - HEADER_SIZE;
+    int c = -1;
+    while (c + 1 < MAG_CLASSES && ((size_t)1 << (c + 1 + MAG_MIN_SHIFT)) <= usable)
+        ++c;
+    /* 过大的chunk不放入magazine，避免占着大块内存 */
+    if (c < 0 || usable >= ((size_t)2 << (c + MAG_MIN_SHIFT)) + sizeof(chunk))
+        return -1;
+    return c;
+}
+
+/* 从主堆批量取对象 */
+static void mag_refill(struct magazine *mag, int c) {
+    unsigned long flags = spin_lock_irqsave(&kmalloc_lock);
+    while (mag->rounds < MAG_BATCH) {
+        void *p = __kmalloc((size_t)1 << (c + MAG_MIN_SHIFT));
+        if (!p)
             break;
+        mag->objs[mag->rounds++] = p;
+    }
+    spin_unlock_irqrestore(&kmalloc_lock, flags);
+}
+
+/* 批量还给主堆 */
+static void mag_drain(struct magazine *mag) {
+    unsigned long flags = spin_lock_irqsave(&kmalloc_lock);
+    while (mag->rounds > MAG_ROUNDS - MAG_BATCH)
+        __kfree(mag->objs[--mag->rounds]);
+    spin_unlock_irqrestore(&kmalloc_lock, flags);
+}
+
+/* 把当前CPU magazine中的对象全部还给主堆，使空页能够被释放；别的CPU的magazine只有它自己能动，
+   统计和检查时单独计算（mag_parked） */
+void kmalloc_drain(void) {
+    preempt_disable();
+    unsigned long flags = spin_lock_irqsave(&kmalloc_lock);
+    struct kmalloc_cpu_cache *cc = &cpu_caches[smp_processor_id()];
+    for (unsigned int c = 0; c < MAG_CLASSES; ++c) {
+        struct magazine *mag = &cc->mags[c];
+        while (mag->rounds > 0)
+            __kfree(mag->objs[--mag->rounds]);
+    }
+    spin_unlock_irqrestore(&kmalloc_lock, flags);
+    preempt_enable();
+}
+
+void *kmalloc(size_t size) {
+    void *p = NULL;
+    if (size == 0)
+        return NULL;
+
+    int c = mag_class(size);
+    if (c >= 0) {
+        unsigned long flags = irq_save();       /* 中断里也会kfree，不能在改rounds/objs的中途被打断 */
+        struct magazine *mag = &cpu_caches[smp_processor_id()].mags[c];
+        if (mag->rounds == 0)
+            mag_refill(mag, c);
+        if (mag->rounds > 0) {
+            p = mag->objs[--mag->rounds];
+            cpu_caches[smp_processor_id()].nr_alloc++;
         }
-        p = p->next;
+        irq_restore(flags);
+        return p;
     }
-    if (need_free_page) {
-        free_pages(&pt->pa);
-        pt->pa.page = 0;
-        pt->pa.npages = 0;
+
+    unsigned long flags = spin_lock_irqsave(&kmalloc_lock);
+    if (size > KMALLOC_LARGE)
+        p = large_alloc(size);
+    if (!p)
+        p = __kmalloc(size);
+    if (p)
+        cpu_caches[smp_processor_id()].nr_alloc++;
+    spin_unlock_irqrestore(&kmalloc_lock, flags);
+    return p;
+}
+
+void kfree(void *mem) {
+    if (!mem) return;
+
+    /* 页对齐的指针可能是大块，不能去读它前面的chunk头 */
+    if (((uintptr_t)mem & (PAGE_SIZE - 1)) == 0) {
+        unsigned long flags = spin_lock_irqsave(&kmalloc_lock);
+        int slot = large_lookup(mem);
+        if (slot >= 0) {
+            large_free(slot);
+            cpu_caches[smp_processor_id()].nr_free++;
+            spin_unlock_irqrestore(&kmalloc_lock, flags);
+            return;
+        }
+        spin_unlock_irqrestore(&kmalloc_lock, flags);
+    }
+
+    int c = mag_chunk_class(mem);
+    if (c >= 0) {
+        unsigned long flags = irq_save();
+        struct magazine *mag = &cpu_caches[smp_processor_id()].mags[c];
+        if (mag->rounds == MAG_ROUNDS)
+            mag_drain(mag);
+        mag->objs[mag->rounds++] = mem;
+        cpu_caches[smp_processor_id()].nr_free++;
+        irq_restore(flags);
+        return;
     }
-    unlock_scheduler();
+
+    unsigned long flags = spin_lock_irqsave(&kmalloc_lock);
+    __kfree(mem);
+    cpu_caches[smp_processor_id()].nr_free++;
+    spin_unlock_irqrestore(&kmalloc_lock, flags);
 }
 
-int kmcheck(void) {
-    for (unsigned int i=0; i<MM_PAGE_NUM; ++i) {
-        page_tag *pt = &(mm_pages[i]);
-        if (pt->pa.page == 0) continue;
+/* 调整已分配内存的大小：缩小时切出尾部，增大时先尝试与后面的空闲chunk合并，都不行才重新分配并拷贝 */
+void *krealloc(void *mem, size_t size) {
+    if (!mem)
+        return kmalloc(size);
+    if (size == 0) {
+        kfree(mem);
+        return NULL;
+    }
+
+    chunk *ck = (chunk*)((char*)mem - HEADER_SIZE);
+    size_t need = kmalloc_round(size) + HEADER_SIZE;
+    size_t old_size = 0;
+
+    unsigned long flags = spin_lock_irqsave(&kmalloc_lock);
+    int slot = large_lookup(mem);
+    if (slot >= 0) {
+        /* 大块：页内放得下就不动 */
+        old_size = large_table[slot].npages * PAGE_SIZE;
+        spin_unlock_irqrestore(&kmalloc_lock, flags);
+        if (size <= old_size)
+            return mem;
+        goto move;
+    }
+
+    page_tag *pt = &mm_pages[ck->page_tag_index];
+    size_t len = memory_chunk_size(ck);
+    chunk *next = container_of(ck->all.next, chunk, all);
+
+    if (need > len && size <= KMALLOC_LARGE && next->used == 0 && len + memory_chunk_size(next) >= need) {
+        /* 原地增长：吞掉后面的空闲chunk */
+        bin_remove(next);
+        list_del(&next->all);
+        pt->mem_meta -= HEADER_SIZE;
+    }
+    if (need <= memory_chunk_size(ck)) {
+        memory_chunk_split(ck, need);
+        pt->mem_used += memory_chunk_size(ck) - len;
+        spin_unlock_irqrestore(&kmalloc_lock, flags);
+        return mem;
+    }
+    old_size = len - HEADER_SIZE;
+    spin_unlock_irqrestore(&kmalloc_lock, flags);
+
+move:;
+    void *p = kmalloc(size);
+    if (!p)
+        return NULL;
+    memcpy(p, mem, old_size < size ? old_size : size);
+    kfree(mem);
+    return p;
+}
+
+/* 分配align对齐的内存，align为2的幂；前面多出的部分切成独立的空闲chunk，因此可以直接kfree */
+void *kmalloc_aligned(size_t size, size_t align) {
+    if (align <= ALIGN)
+        return kmalloc(size);
+    if (size == 0 || (align & (align - 1)))
+        return NULL;
+    if (size > KMALLOC_LARGE && align <= PAGE_SIZE)
+        return kmalloc(size);                                                          /* 大块本身就是页对齐的 */
+
+    size = kmalloc_round(size);
+    unsigned long flags = spin_lock_irqsave(&kmalloc_lock);
+    char *p = __kmalloc(size + align + sizeof(chunk));
+    if (!p)
+        goto end;
+    cpu_caches[smp_processor_id()].nr_alloc++;
+
+    /* 前面至少留出一个chunk的空间，才能切成空闲chunk */
+    char *aligned = (char*)(((uintptr_t)p + sizeof(chunk) + align - 1) & ~(uintptr_t)(align - 1));
+    if (((uintptr_t)p & (align - 1)) != 0) {
+        chunk *ck = (chunk*)(p - HEADER_SIZE);
+        chunk *nck = (chunk*)(aligned - HEADER_SIZE);
+        page_tag *pt = &mm_pages[ck->page_tag_index];
+
+        pt->mem_used -= memory_chunk_size(ck) - HEADER_SIZE;
+        memory_chunk_init(nck, ck->page_tag_index);
+        list_add(&nck->all, &ck->all);
+        nck->used = 1;
+        pt->mem_meta += HEADER_SIZE;
+        pt->mem_used += memory_chunk_size(nck) - HEADER_SIZE;
+
+        /* ck刚从bin中取出，前一个chunk一定是used，无需合并 */
+        ck->used = 0;
+        INIT_LIST_HEAD(&ck->free);
+        bin_insert(ck);
+        p = aligned;
+    }
+
+    /* 切掉尾部多余的部分 */
+    chunk *ck = (chunk*)(p - HEADER_SIZE);
+    page_tag *pt = &mm_pages[ck->page_tag_index];
+    size_t len = memory_chunk_size(ck);
+    memory_chunk_split(ck, size + HEADER_SIZE);
+    pt->mem_used -= len - memory_chunk_size(ck);
+
+end:
+    spin_unlock_irqrestore(&kmalloc_lock, flags);
+    return p;
+}
+
+/* 校验单个页：all list前后指针一致、chunk都在页内且属于本页、used chunk数与nr_used一致 */
+static int kmcheck_page(unsigned int index) {
+    page_tag *pt = &(mm_pages[index]);
+    char *start = (char*)pt->pa.page;
+    char *end = start + pt->pa.npages * PAGE_SIZE;
+    unsigned int nr_used = 0;
+
+    chunk *t = pt->last;
+    struct list_head *it = &pt->first->all;
+    do {
+        chunk *tmp = container_of(it->prev, chunk, all);
+        chunk *tmp1 = container_of(it, chunk, all);
+        if (tmp != t) {
+            printk("kmcheck: page %u chunk %x: all list broken (prev %x, expect %x)\n", index, tmp1, tmp, t);
+            return -1;
+        }
+        if ((char*)tmp1 < start || (char*)tmp1 >= end || tmp1->page_tag_index != index) {
+            printk("kmcheck: page %u chunk %x: chunk outside page\n", index, tmp1);
+            return -1;
+        }
+        if (tmp1->used && tmp1 != pt->first && tmp1 != pt->last)
+            nr_used++;
+        t = tmp1;
+        it = it->next;
+    } while (it != &pt->first->all);
+
+    if (nr_used != pt->nr_used) {
+        printk("kmcheck: page %u: %u used chunks, nr_used %u\n", index, nr_used, pt->nr_used);
+        return -1;
+    }
+    return 0;
+}
 
-        chunk *t = pt->last;
+/* 校验所有页和所有bin，发现问题时打印出错的页/chunk/链表并返回-1；调用者需持有kmalloc_lock */
+static int __kmcheck(void) {
+    int ret = 0;
 
-        struct list_head *it = &pt->first->all;
-        do {
-            chunk *tmp = container_of(it->prev, chunk, all);
-            chunk *tmp1 = container_of(it, chunk, all);
-            if (tmp != t) {
-                return -1;
+    if (!kmemory_ready)
+        goto end;
+
+    for (unsigned int i=0; i<MM_PAGE_NUM; ++i) {
+        if (mm_pages[i].pa.page == 0) continue;
+        if (kmcheck_page(i) != 0) {
+            ret = -1;
+            goto end;
+        }
+    }
+
+    for (unsigned int i = 0; i < NUM_SIZES; ++i) {
+        struct list_head *it;
+        if (list_empty(&free_bins[i]) == ((free_bin_map >> i) & 1)) {
+            printk("kmcheck: bin %u: bin map out of sync\n", i);
+            ret = -1;
+            goto end;
+        }
+        list_for_each(it, &free_bins[i]) {
+            chunk *ck = container_of(it, chunk, free);
+            if (it->next->prev != it) {
+                printk("kmcheck: bin %u chunk %x: free list broken\n", i, ck);
+                ret = -1;
+                goto end;
+            }
+            if (ck->used) {
+                printk("kmcheck: bin %u chunk %x: used chunk in free list\n", i, ck);
+                ret = -1;
+                goto end;
             }
-            t = tmp1;
-            it = it->next;
-        } while (it != &pt->first->all);
-
-        for (unsigned int i = 0; i < NUM_SIZES; ++i) {
-            if (pt->free_chunk[i]) {
-                t = container_of(pt->free_chunk[i]->free.prev, chunk, free);
-
-                struct list_head *it = &pt->free_chunk[i]->free;
-                do {
-                    chunk *tmp = container_of(it->prev, chunk, free);
-                    chunk *tmp1 = container_of(it->prev, chunk, free);
-                    if (tmp != t) {
-                        return -1;
-                    }
-                    t = tmp1;
-                    it = it->next;
-                } while (it != &pt->free_chunk[i]->free);
+            if (ck->page_tag_index >= MM_PAGE_NUM || mm_pages[ck->page_tag_index].pa.page == 0) {
+                printk("kmcheck: bin %u chunk %x: chunk of released page %u\n", i, ck, ck->page_tag_index);
+                ret = -1;
+                goto end;
+            }
+            if (memory_chunk_slot(memory_chunk_size(ck)) != (int)i) {
+                printk("kmcheck: bin %u chunk %x: chunk of size %u in wrong bin\n", i, ck, memory_chunk_size(ck));
+                ret = -1;
+                goto end;
             }
         }
     }
 
-    return 0;
+end:
+    return ret;
+}
+
+int kmcheck(void) {
+    unsigned long flags = spin_lock_irqsave(&kmalloc_lock);
+    int ret = __kmcheck();
+    spin_unlock_irqrestore(&kmalloc_lock, flags);
+    return ret;
+}
+
+#if KMCHECK_PERIOD > 0
+/* 维护任务，定期校验堆 */
+static void kmcheck_work(void) {
+    for (;;) {
+        nano_sleep_until(get_timer_count() + KMCHECK_PERIOD);
+        kmcheck();
+    }
+}
+#endif
+
+void kmcheck_init(void) {
+#if KMCHECK_PERIOD > 0
+    create_task(kmcheck_work);
+#endif
+}
+
+/* 调用者需持有kmalloc_lock：各CPU的magazine中属于第index页（index为MM_PAGE_NUM时不限页）的对象数。
+   别的CPU的快速路径不取锁，读到的数只可用于统计和检查 */
+static unsigned int mag_parked(unsigned int index) {
+    unsigned int n = 0;
+    for (unsigned int cpu = 0; cpu < NR_CPUS; ++cpu) {
+        for (unsigned int c = 0; c < MAG_CLASSES; ++c) {
+            struct magazine *mag = &cpu_caches[cpu].mags[c];
+            for (unsigned int k = 0; k < mag->rounds; ++k) {
+                chunk *ck = (chunk*)((char*)mag->objs[k] - HEADER_SIZE);
+                if (index == MM_PAGE_NUM || ck->page_tag_index == index)
+                    n++;
+            }
+        }
+    }
+    return n;
 }
 
+/* 页中的chunk都停在magazine里时不算泄漏 */
 int km_freecheck(void) {
+    int count = 0;
+    kmalloc_drain();
+    unsigned long flags = spin_lock_irqsave(&kmalloc_lock);
+    unsigned int parked = mag_parked(MM_PAGE_NUM);
     for (unsigned int i=0; i<MM_PAGE_NUM; ++i) {
         page_tag *pt = &(mm_pages[i]);
-        if (pt->pa.page != 0) {
+        if (pt->pa.page != 0 && pt->nr_used > mag_parked(i)) {
             printk("non freed page found! ");
+            count++;
         }
     }
-} 
+    spin_unlock_irqrestore(&kmalloc_lock, flags);
+    if (parked)
+        printk("%u objects parked in magazines of other cpus ", (unsigned long)parked);
+    if (large_count) {
+        printk("%u large blocks not freed! ", large_count);
+        count += large_count;
+    }
+    if (count)
+        kmem_dump();
+    return count;
+}
+
+void kmem_get_stat(struct kmem_stat *st) {
+    memset(st, 0, sizeof(*st));
+
+    unsigned long flags = spin_lock_irqsave(&kmalloc_lock);
+    kmemory_init();
+    for (unsigned int i = 0; i < MM_PAGE_NUM; ++i) {
+        page_tag *pt = &mm_pages[i];
+        if (pt->pa.page == 0)
+            continue;
+        st->nr_page_tags++;
+        st->heap_pages += pt->pa.npages;
+        st->mem_used += pt->mem_used;
+        st->mem_free += pt->mem_free;
+        st->mem_meta += pt->mem_meta;
+        /* first/last是哨兵，不计入 */
+        for (chunk *ck = container_of(pt->first->all.next, chunk, all); ck != pt->last;
+             ck = container_of(ck->all.next, chunk, all)) {
+            size_t len = memory_chunk_size(ck);
+            if (ck->used)
+                st->class_used[memory_chunk_slot(len)] += len - HEADER_SIZE;
+            else if (len - HEADER_SIZE > st->largest_free)
+                st->largest_free = len - HEADER_SIZE;
+        }
+    }
+    for (unsigned int i = 0; i < NUM_SIZES; ++i) {
+        struct list_head *it;
+        list_for_each(it, &free_bins[i])
+            st->bin_free[i] += memory_chunk_size(container_of(it, chunk, free)) - HEADER_SIZE;
+    }
+    for (unsigned int i = 0; i < LARGE_SLOTS; ++i)
+        st->large_pages += large_table[i].npages;
+    st->nr_large = large_count;
+    /* magazine中的对象在chunk堆看来是已分配的，从已用中扣出来单独计 */
+    for (unsigned int cpu = 0; cpu < NR_CPUS; ++cpu) {
+        struct kmalloc_cpu_cache *cc = &cpu_caches[cpu];
+        for (unsigned int c = 0; c < MAG_CLASSES; ++c) {
+            struct magazine *mag = &cc->mags[c];
+            for (unsigned int k = 0; k < mag->rounds; ++k) {
+                size_t len = memory_chunk_size((chunk*)((char*)mag->objs[k] - HEADER_SIZE));
+                st->class_used[memory_chunk_slot(len)] -= len - HEADER_SIZE;
+                st->mem_used -= len - HEADER_SIZE;
+                st->mag_cached += len - HEADER_SIZE;
+            }
+        }
+        st->nr_alloc += cc->nr_alloc;
+        st->nr_free += cc->nr_free;
+    }
+    spin_unlock_irqrestore(&kmalloc_lock, flags);
 
+    if (st->mem_free)
+        st->frag = 1000 - st->largest_free * 1000 / st->mem_free;
+}
 
+/* 打印堆和页分配器的统计，速率按与上一次调用的间隔计算（timer为1000Hz） */
+void kmem_dump(void) {
+    static unsigned long last_tick = 0, last_alloc = 0, last_free = 0;
+    struct kmem_stat st;
+    kmem_get_stat(&st);
+
+    unsigned long now = get_timer_count();
+    unsigned long ms = now - last_tick;
+    printk("kmem: used %u, free %u, meta %u, magazines %u\n", st.mem_used, st.mem_free, st.mem_meta, st.mag_cached);
+    printk("kmem: heap pages %u (%u/%u tags), large %u blocks/%u pages\n",
+           st.heap_pages, (unsigned long)st.nr_page_tags, (unsigned long)MM_PAGE_NUM,
+           (unsigned long)st.nr_large, st.large_pages);
+    printk("kmem: largest free %u, frag %u.%u%%\n", st.largest_free,
+           (unsigned long)(st.frag / 10), (unsigned long)(st.frag % 10));
+    printk("kmem: %u allocs, %u frees", st.nr_alloc, st.nr_free);
+    if (ms > 0)
+        printk(", %u allocs/s, %u frees/s", (st.nr_alloc - last_alloc) * 1000 / ms,
+               (st.nr_free - last_free) * 1000 / ms);
+    printk("\n");
+    for (unsigned int i = 0; i < NUM_SIZES; ++i) {
+        if (st.class_used[i] || st.bin_free[i])
+            printk("kmem: class %u (<%u): used %u, free %u\n", (unsigned long)i,
+                   (unsigned long)2 << i, st.class_used[i], st.bin_free[i]);
+    }
+    last_tick = now;
+    last_alloc = st.nr_alloc;
+    last_free = st.nr_free;
 
+    frame_stat_dump();
+}
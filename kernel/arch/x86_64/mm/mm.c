@@ -1,36 +1,108 @@
-
 #include <kernel/page.h>
 #include <kernel/string.h>
+#include <kernel/slab.h>
 #include "../include/defs.h"
 #include "../cpu/cpu.h"
+#include <kernel/spinlock.h>
+#include "../sched/task.h"
 #include "mm.h"
+#include "pcid.h"
 
 #define TASK_STACK_PAGE_NUM     10
+#define STACK_POOL_SIZE         16              /* 最多缓存的栈对数 */
 
 const uint64_t mm_rsp_offset = offset_of(struct mm_struct, rsp);
 const uint64_t mm_rsp0_offset = offset_of(struct mm_struct, rsp0);
 const uint64_t mm_tss_rsp0_offset = offset_of(struct mm_struct, tss_rsp0);
-const uint64_t mm_cr3_offset = offset_of(struct mm_struct, cr3);
+
+/* 任务终止后回收的内核栈和用户栈，创建任务时优先复用，避免反复调用页分配器 */
+struct stack_pair {
+    struct page_alloc stack0;
+    struct page_alloc stack;
+};
+static struct stack_pair stack_pool[STACK_POOL_SIZE];
+static unsigned int stack_pool_count = 0;
+static spinlock_t stack_pool_lock = SPINLOCK_INIT;
+struct pool_stat stack_pool_stat = {0, 0};
+
+struct kmem_cache *mm_cache = NULL;
+
+static int alloc_stack_pair(struct stack_pair *sp) {
+    sp->stack0 = alloc_pages(TASK_STACK_PAGE_NUM);
+    if (sp->stack0.page == 0) return -1;
+    sp->stack = alloc_pages(TASK_STACK_PAGE_NUM);
+    if (sp->stack.page == 0) {
+        free_pages(&sp->stack0);
+        return -1;
+    }
+    return 0;
+}
+
+/* 创建mm_struct的slab cache，并预先分配count对栈放入池中 */
+void mm_pool_init(unsigned int count) {
+    if (!mm_cache)
+        mm_cache = kmem_cache_create("mm_struct", sizeof(struct mm_struct), NULL);
+
+    unsigned long flags = spin_lock_irqsave(&stack_pool_lock);
+    while (count-- > 0 && stack_pool_count < STACK_POOL_SIZE) {
+        if (alloc_stack_pair(&stack_pool[stack_pool_count]) != 0)
+            break;
+        stack_pool_count++;
+    }
+    spin_unlock_irqrestore(&stack_pool_lock, flags);
+}
+
+struct mm_struct *mm_alloc(void) {
+    return (struct mm_struct *)kmem_cache_alloc(mm_cache);
+}
+
+void mm_free(struct mm_struct *mm) {
+    kmem_cache_free(mm_cache, mm);
+}
 
 int mm_init(struct mm_struct *mm) {
+    struct stack_pair sp;
+    int hit = 0;
+
     if (!mm) return -1;
 
     memset(mm, 0, sizeof(struct mm_struct));
-    mm->stack0 = alloc_pages(TASK_STACK_PAGE_NUM);
-    if (mm->stack0.page == 0) return -1;
-    mm->rsp0 = mm->stack0.page + mm->stack0.npages * PAGE_SIZE;
-    mm->tss_rsp0 = mm->rsp0;
-    mm->stack = alloc_pages(TASK_STACK_PAGE_NUM);
-    if (mm->stack.page == 0) {
-        free_pages(&mm->stack0);
-        return -1;
+    unsigned long flags = spin_lock_irqsave(&stack_pool_lock);
+    if (stack_pool_count > 0) {
+        sp = stack_pool[--stack_pool_count];
+        stack_pool_stat.hits++;
+        hit = 1;
+    } else {
+        stack_pool_stat.misses++;
     }
-    mm->rsp =  mm->stack.page + mm->stack.npages * PAGE_SIZE;
-    mm->cr3 = getcr3();
+    spin_unlock_irqrestore(&stack_pool_lock, flags);
+    if (!hit && alloc_stack_pair(&sp) != 0)
+        return -1;
+
+    mm->stack0 = sp.stack0;
+    mm->rsp0 = (void *)((uint64_t)mm->stack0.page + mm->stack0.npages * PAGE_SIZE);      /* page是uint64_t *，按字节算 */
+    mm->tss_rsp0 = mm->rsp0;
+    mm->stack = sp.stack;
+    mm->rsp = (void *)((uint64_t)mm->stack.page + mm->stack.npages * PAGE_SIZE);
+    mm->cr3 = getcr3() & CR3_ADDR_MASK;
+    mm->pcid = pcid_get(mm->cr3);
     return 0;
 }
 
 void mm_clean(struct mm_struct *mm) {
+    pcid_put(mm->cr3, mm->pcid);
+    mm->pcid = 0;
+
+    unsigned long flags = spin_lock_irqsave(&stack_pool_lock);
+    if (stack_pool_count < STACK_POOL_SIZE) {
+        stack_pool[stack_pool_count].stack0 = mm->stack0;
+        stack_pool[stack_pool_count].stack = mm->stack;
+        stack_pool_count++;
+        mm->stack0.npages = 0;
+        mm->stack.npages = 0;
+    }
+    spin_unlock_irqrestore(&stack_pool_lock, flags);
+
     free_pages(&mm->stack0);
     free_pages(&mm->stack);
-}
\ No newline at end of file
+}
@@ -15,7 +15,8 @@ struct mm_struct {
     void* rsp;                              /* the task's kernel stack */
     void* tss_rsp0;                         /* top of kernel stack to set on tss->rsp0*/ 
     void* rsp0;                             /* kernel stack */
-    uint32_t cr3;                           /* the task's virtual address space*/
+    uint64_t cr3;                           /* the task's virtual address space，页表的物理地址 */
+    uint16_t pcid;                          /* 地址空间号，0表示没有分到 */
 
     unsigned long start_code, end_code, start_data, end_data;
     unsigned long start_brk, brk;
@@ -32,12 +33,23 @@ struct vm_area_struct {
     struct list_head vma_list;
 };
 
+/* 对象池的命中统计 */
+struct pool_stat {
+    unsigned long hits;
+    unsigned long misses;
+};
+
+extern struct pool_stat stack_pool_stat;
+extern struct kmem_cache *mm_cache;
+
 extern const uint64_t mm_rsp_offset;
 extern const uint64_t mm_rsp0_offset;
-extern const uint64_t mm_cr3_offset;
 extern const uint64_t mm_state_offset;
 
 int mm_init(struct mm_struct *mm);
 void mm_clean(struct mm_struct *mm);
+struct mm_struct *mm_alloc(void);
+void mm_free(struct mm_struct *mm);
+void mm_pool_init(unsigned int count);
 
 #endif
\ No newline at end of file
@@ -1,38 +1,94 @@
-
 #include <stddef.h>
+#include <kernel/list.h>
 #include "../include/constant.h"
 #include "ram.h"
 #include "pagemanager.h"
+#include "bitmap.h"
 #include "pgtable.h"
 #include <kernel/page.h>
 #include <kernel/printk.h>
+#include <kernel/spinlock.h>
 
 
-/* 页分配有很多方法，如bitmap、stack/list、buddy alocations等，这里用最简单的bitmap */
+/* 页分配有很多方法，如bitmap、stack/list、buddy alocations等，这里用buddy，bitmap只用来记录页帧是否被占用 */
 #define MEM_END       (0xffffffff80000000 + 512 * 4096)               /* 暂时只讨论当前映射的一个页目录项 */
-#define UINT64_BITS                           64
 #define PRE_ALLOCATING_NUM                    20
 
 /* 用来计算内核代码之后的 address of first page frame */
 extern uint64_t _kernel_end;
 
+/* 每个页帧的描述符，放在frame_map之后 */
+struct page_frame {
+    struct list_head list;                  /* 空闲块链表节点，只在空闲块的首页有效 */
+    uint8_t order;                          /* 空闲块的阶 */
+    uint8_t free;                           /* 是否为空闲块的首页 */
+};
 
+/* 每一阶的空闲块链表 */
+struct free_area {
+    struct list_head free_list;
+    uint64_t nr_free;
+};
 
 uint64_t npages = 0;                        /* npages表示可分配的页个数，因为链接后才能得到 _kernel_end 的值，所以无法在编译期间计算，要运行之后计算 */
 uint64_t *frame_map = NULL;                 /* frame_map标记某个页是否被使用，要放置在_kernel_end，同样也要运行之后计算 */
 uint64_t *startframe = NULL;                /* 页帧起点，运行之后确定值 */
+static struct page_frame *frame_table = NULL;          /* 页帧描述符数组，紧跟在frame_map后面 */
+static struct free_area free_area[MAX_ORDER];
+static uint64_t nr_used_pages = 0;
+static uint64_t nr_alloc = 0, nr_free_calls = 0, nr_failed = 0;
+static spinlock_t page_lock = SPINLOCK_INIT;            /* 保护buddy链表、frame_map和统计 */
+
+/* buddy operation */
+static unsigned int count_to_order(size_t count) {
+    unsigned int order = 0;
+    while (((size_t)1 << order) < count)
+        ++order;
+    return order;
+}
 
-/* frame map operation */
-static uint64_t get_frame_map(unsigned int index) {
-    return (frame_map[index / UINT64_BITS] & (1 << (index % UINT64_BITS)))== 0 ? 0 : 1;
+static void free_area_add(uint64_t index, unsigned int order) {
+    struct page_frame *pf = &frame_table[index];
+    pf->order = order;
+    pf->free = 1;
+    list_add(&pf->list, &free_area[order].free_list);
+    free_area[order].nr_free++;
 }
-static void set_frame_map(unsigned int index, uint64_t val) {
-    if (val > 0)
-        frame_map[index/UINT64_BITS] |= 1 << (index % UINT64_BITS);
-    else
-        frame_map[index/UINT64_BITS] &= ~(1 << (index % UINT64_BITS));
+
+static void free_area_del(uint64_t index) {
+    struct page_frame *pf = &frame_table[index];
+    list_del(&pf->list);
+    pf->free = 0;
+    free_area[pf->order].nr_free--;
 }
 
+/* 释放一个按 2^order 对齐的块，并尽可能地与伙伴合并 */
+static void buddy_free_block(uint64_t index, unsigned int order) {
+    while (order < MAX_ORDER - 1) {
+        uint64_t buddy = index ^ ((uint64_t)1 << order);
+        if (buddy + ((uint64_t)1 << order) > npages)
+            break;
+        struct page_frame *bf = &frame_table[buddy];
+        if (!bf->free || bf->order != order)
+            break;
+        free_area_del(buddy);
+        index &= buddy;                     /* 合并后的块从两者中较小的地址开始 */
+        ++order;
+    }
+    free_area_add(index, order);
+}
+
+/* 把任意区间 [start, start+count) 拆成若干对齐的块释放，最多 2*MAX_ORDER 个块 */
+static void buddy_free_range(uint64_t start, uint64_t count) {
+    while (count > 0) {
+        unsigned int order = 0;
+        while (order < MAX_ORDER - 1 && !(start & ((uint64_t)1 << order)) && ((uint64_t)2 << order) <= count)
+            ++order;
+        buddy_free_block(start, order);
+        start += (uint64_t)1 << order;
+        count -= (uint64_t)1 << order;
+    }
+}
 
 // 函数 kalloc_frame_init 用于分配并初始化一个页面帧
 void kalloc_frame_init() {
@@ -42,55 +98,117 @@ void kalloc_frame_init() {
     /* frame_map要sizeof(page_status)对齐 */
     if (!frame_map) {
         frame_map = (uint64_t *)(&_kernel_end + 1);
-        /* 在frame_map后面填充其数据以及确定startframe */
-        /* 首先要选一个合适的npages，设置为一个接近值x，则(x*4096 + x / 64) < (ram_end -  frame_map)， 解出 x = (ram_end - frame_map) / (4096 + 1/64), 实际上除数可以算成4097来估算 */
-        npages = (ram_end + HIGHER_HALF_OFFSET - (uint64_t)frame_map) / (PAGE_SIZE + 1);
-        /* 得到npages，即可容易算出startframe，注意4k对齐 */
-        startframe = frame_map + (npages / UINT64_BITS);
+        /* 在frame_map后面填充其数据、页帧描述符以及确定startframe */
+        /* 首先要选一个合适的npages，每页除了4096字节外还需要一个描述符和1 bit，据此估算 x */
+        npages = (ram_end + HIGHER_HALF_OFFSET - (uint64_t)frame_map) / (PAGE_SIZE + sizeof(struct page_frame) + 1);
+        /* 得到npages，即可容易算出frame_table和startframe，注意4k对齐 */
+        frame_table = (struct page_frame *)(frame_map + BITMAP_WORDS(npages));
+        startframe = (uint64_t *)(frame_table + npages);
         if ((uint64_t)startframe % PAGE_SIZE != 0)
             startframe = (uint64_t*)(((uint64_t)startframe / PAGE_SIZE + 1) * PAGE_SIZE);
         /* 检查页面是否超出内存，注意这里要考虑到VGA video占用的页，所以在比较的时候要减去4096 */
         while (startframe + PAGE_SIZE * npages > ram_end + HIGHER_HALF_OFFSET - PAGE_SIZE)
             npages--;
-        for (uint64_t *p = frame_map; p < startframe; ++p)
+        for (uint64_t *p = frame_map; p < (uint64_t *)frame_table; ++p)
             *p = 0;
-    }
-}
-
-static int check_continuous_free_page(uint64_t start, size_t count) {
-    if (start + count >= npages) return -1;     /* out of page frame range */
+        for (uint64_t i = 0; i < npages; ++i) {
+            frame_table[i].order = 0;
+            frame_table[i].free = 0;
+        }
 
-    for (unsigned int i=0; i<count; ++i) {
-        if (get_frame_map(start + i))
-            return -1;
+        /* 所有页帧都作为空闲块加入buddy */
+        for (unsigned int i = 0; i < MAX_ORDER; ++i) {
+            INIT_LIST_HEAD(&free_area[i].free_list);
+            free_area[i].nr_free = 0;
+        }
+        buddy_free_range(0, npages);
     }
-    return 0;
 }
 
 struct page_alloc alloc_pages(size_t count) {
     struct page_alloc pa = {0, 0};
+    unsigned long flags = spin_lock_irqsave(&page_lock);
     if (count >= npages || count == 0)
-        return pa;
-    for (unsigned int i=0; i <= npages - count; ++i) {
-        if (check_continuous_free_page(i, count) == 0) {
-            for (unsigned int j=0; j<count; ++j)
-                set_frame_map(i + j, 1);
-            pa.page = (char*)startframe + (i * PAGE_SIZE);
-            pa.npages = count;
-            return pa;
-        }
+        goto fail;
+
+    unsigned int order = count_to_order(count);
+    if (order >= MAX_ORDER)
+        goto fail;
+
+    /* 从满足大小的最小阶开始查找空闲块 */
+    unsigned int k = order;
+    while (k < MAX_ORDER && list_empty(&free_area[k].free_list))
+        ++k;
+    if (k == MAX_ORDER)
+        goto fail;
+
+    struct page_frame *pf = container_of(free_area[k].free_list.next, struct page_frame, list);
+    uint64_t index = pf - frame_table;
+    free_area_del(index);
+
+    /* 拆分大块，高地址的一半放回低一阶的空闲链表 */
+    while (k > order) {
+        --k;
+        free_area_add(index + ((uint64_t)1 << k), k);
     }
+    /* 多申请的尾部页立即归还，避免10页的栈占用16页 */
+    if (count < ((size_t)1 << order))
+        buddy_free_range(index + count, ((uint64_t)1 << order) - count);
+
+    bitmap_set_range(frame_map, index, count);
+    nr_used_pages += count;
+    nr_alloc++;
+    pa.page = (pageframe_t)((char*)startframe + (index * PAGE_SIZE));
+    pa.npages = count;
+    spin_unlock_irqrestore(&page_lock, flags);
+    return pa;
+
+fail:
+    nr_failed++;
+    spin_unlock_irqrestore(&page_lock, flags);
     return pa;
 }
 
 void free_pages(struct page_alloc *pa) {
     if (pa->npages != 0) {
-        unsigned int start = (pa->page - startframe) / PAGE_SIZE;
-        for (unsigned int i=start; i<start + pa->npages; ++i)
-            set_frame_map(i, 0);
+        uint64_t start = ((char*)pa->page - (char*)startframe) / PAGE_SIZE;
+        if (start + pa->npages > npages)
+            return;
+        unsigned long flags = spin_lock_irqsave(&page_lock);
+        if (!bitmap_test(frame_map, start)) {
+            spin_unlock_irqrestore(&page_lock, flags);
+            printk("free_pages: page %u is not allocated\n", start);
+            return;
+        }
+        bitmap_clear_range(frame_map, start, pa->npages);
+        buddy_free_range(start, pa->npages);
+        nr_used_pages -= pa->npages;
+        nr_free_calls++;
+        spin_unlock_irqrestore(&page_lock, flags);
     }
 }
 
+void frame_get_stat(struct frame_stat *st) {
+    st->total = npages;
+    st->used = nr_used_pages;
+    for (unsigned int i = 0; i < MAX_ORDER; ++i)
+        st->nr_free[i] = free_area[i].nr_free;
+    st->nr_alloc = nr_alloc;
+    st->nr_free_calls = nr_free_calls;
+    st->nr_failed = nr_failed;
+}
+
+void frame_stat_dump(void) {
+    struct frame_stat st;
+    frame_get_stat(&st);
+    printk("frames: %u/%u used, %u allocs, %u frees, %u failed\n",
+           st.used, st.total, st.nr_alloc, st.nr_free_calls, st.nr_failed);
+    printk("frames free blocks by order:");
+    for (unsigned int i = 0; i < MAX_ORDER; ++i)
+        printk(" %u", st.nr_free[i]);
+    printk("\n");
+}
+
 void page_fault_handler(struct pt_regs *regs) {
     printk("\nIn exception 14\n Address: %u\n", getcr2());
     __asm__ volatile ("hlt");
@@ -8,14 +8,27 @@
 /* 页帧格式 */
 typedef uint64_t *pageframe_t;
 
+#define MAX_ORDER                             11              /* 最大的块为 2^(MAX_ORDER-1) 页，即4MB */
+
 struct page_alloc {
     pageframe_t page;
     uint64_t npages;
 };
 
+/* 页分配器统计 */
+struct frame_stat {
+    uint64_t total;                         /* 可分配的页数 */
+    uint64_t used;                          /* 已分配的页数 */
+    uint64_t nr_free[MAX_ORDER];            /* 每一阶的空闲块数 */
+    uint64_t nr_alloc, nr_free_calls;       /* 累计的alloc_pages/free_pages次数 */
+    uint64_t nr_failed;                     /* 失败的alloc_pages次数 */
+};
+
 void kalloc_frame_init();
 struct page_alloc alloc_pages(size_t count);
 void free_pages(struct page_alloc *pa);
+void frame_get_stat(struct frame_stat *st);
+void frame_stat_dump(void);
 void page_fault_handler(struct pt_regs *regs);
 
 #endif
\ No newline at end of file
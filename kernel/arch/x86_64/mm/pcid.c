@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <kernel/printk.h>
+#include <kernel/spinlock.h>
+#include "../cpu/cpu.h"
+#include "../cpu/smp.h"
+#include "bitmap.h"
+#include "mm.h"
+#include "pcid.h"
+
+#define CR4_PCIDE                   (1 << 17)
+#define CPUID_1_ECX_PCID            (1 << 17)
+#define CPUID_7_EBX_INVPCID         (1 << 10)
+#define INVPCID_SINGLE_CONTEXT      1
+#define PCID_ROOTS                 64          /* 同时分到PCID的页表根的个数，再多的用PCID 0 */
+
+static int pcid_enabled = 0;
+static int invpcid_supported = 0;
+
+/* 已分配的PCID；按顺序向后找空闲的号，推迟重用，让旧的TLB项自然被挤掉 */
+static uint64_t pcid_used[BITMAP_WORDS(PCID_MAX)];
+static uint64_t pcid_next = 1;
+static spinlock_t pcid_lock = SPINLOCK_INIT;
+
+/* 每个CPU上可能还留有旧TLB项的PCID，只有所属CPU清除，切换到这样的PCID时刷新 */
+static uint64_t pcid_stale[NR_CPUS][BITMAP_WORDS(PCID_MAX)];
+
+/* PCID按页表根分配，共用页表的mm共用一个PCID，由pcid_lock保护 */
+struct pcid_root {
+    uint64_t root;
+    uint16_t pcid;
+    unsigned int users;
+};
+static struct pcid_root pcid_roots[PCID_ROOTS];
+static uint64_t kernel_root = 0;                /* 启动时的页表，固定用PCID 0 */
+
+static inline unsigned long read_cr4(void) {
+    unsigned long v;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(unsigned long v) {
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+static inline uint64_t read_cr3(void) {
+    uint64_t v;
+    __asm__ volatile ("mov %%cr3, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr3(uint64_t v) {
+    __asm__ volatile ("mov %0, %%cr3" : : "r"(v) : "memory");
+}
+
+/* 作废本CPU上某个PCID的所有非全局TLB项 */
+static inline void invpcid_single(uint16_t pcid) {
+    struct { uint64_t pcid, addr; } desc = { pcid, 0 };
+    __asm__ volatile ("invpcid %0, %1" : : "m"(desc), "r"((unsigned long)INVPCID_SINGLE_CONTEXT) : "memory");
+}
+
+/* BSP调用一次，检测PCID和INVPCID */
+void pcid_init(void) {
+    unsigned int a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    pcid_enabled = (c & CPUID_1_ECX_PCID) != 0;
+    cpuid(0, 0, &a, &b, &c, &d);
+    if (a >= 7) {
+        cpuid(7, 0, &a, &b, &c, &d);
+        invpcid_supported = (b & CPUID_7_EBX_INVPCID) != 0;
+    }
+    bitmap_set_range(pcid_used, 0, 1);
+    kernel_root = read_cr3() & CR3_ADDR_MASK;
+    pcid_init_cpu();
+    printk("pcid: %s%s\n", pcid_enabled ? "enabled" : "unsupported", invpcid_supported ? ", invpcid" : "");
+}
+
+/* 每个CPU都要调用；打开PCIDE时CR3的PCID必须为0 */
+void pcid_init_cpu(void) {
+    uint64_t cr3 = read_cr3();
+    if (pcid_enabled) {
+        if (cr3 & CR3_PCID_MASK) {
+            cr3 &= CR3_ADDR_MASK;
+            write_cr3(cr3);
+        }
+        write_cr4(read_cr4() | CR4_PCIDE);
+    }
+    this_cpu()->cr3 = cr3;
+}
+
+/* 调用者持有pcid_lock，号用完时返回0 */
+static uint16_t pcid_alloc(void) {
+    int64_t pcid = bitmap_find_free_run(pcid_used, PCID_MAX, pcid_next, 1);
+    if (pcid < 0)
+        pcid = bitmap_find_free_run(pcid_used, PCID_MAX, 1, 1);
+    if (pcid < 0)
+        return 0;
+    bitmap_set_range(pcid_used, pcid, 1);
+    pcid_next = pcid + 1 < PCID_MAX ? pcid + 1 : 1;
+    return pcid;
+}
+
+/* 新分到的号在所有CPU上都标为过期，本CPU能用INVPCID的话立即作废 */
+static void pcid_mark_stale(uint16_t pcid) {
+    uint64_t bit = (uint64_t)1 << (pcid % BITMAP_WORD_BITS);
+    for (unsigned int i = 0; i < NR_CPUS; ++i)
+        __atomic_fetch_or(&pcid_stale[i][pcid / BITMAP_WORD_BITS], bit, __ATOMIC_RELAXED);
+    if (invpcid_supported) {
+        unsigned long flags = irq_save();
+        invpcid_single(pcid);
+        __atomic_fetch_and(&pcid_stale[smp_processor_id()][pcid / BITMAP_WORD_BITS], ~bit, __ATOMIC_RELAXED);
+        irq_restore(flags);
+    }
+}
+
+/* 页表根root对应的PCID，第一个使用者分配，之后的共用；启动时的页表总是0。
+   没有PCID或号用完时返回0，切到这样的地址空间会刷新TLB */
+uint16_t pcid_get(uint64_t root) {
+    struct pcid_root *slot = NULL;
+    uint16_t pcid = 0;
+    int fresh = 0;
+
+    if (!pcid_enabled || root == kernel_root)
+        return 0;
+    unsigned long flags = spin_lock_irqsave(&pcid_lock);
+    for (unsigned int i = 0; i < PCID_ROOTS; ++i) {
+        if (pcid_roots[i].users && pcid_roots[i].root == root) {
+            slot = &pcid_roots[i];
+            break;
+        }
+        if (!pcid_roots[i].users && !slot)
+            slot = &pcid_roots[i];
+    }
+    if (slot && slot->users) {
+        slot->users++;
+        pcid = slot->pcid;
+    } else if (slot && (pcid = pcid_alloc()) != 0) {
+        slot->root = root;
+        slot->pcid = pcid;
+        slot->users = 1;
+        fresh = 1;
+    }
+    spin_unlock_irqrestore(&pcid_lock, flags);
+    if (fresh)
+        pcid_mark_stale(pcid);
+    return pcid;
+}
+
+/* 与pcid_get配对，root的最后一个使用者放掉时回收它的号 */
+void pcid_put(uint64_t root, uint16_t pcid) {
+    if (pcid == 0)
+        return;
+    unsigned long flags = spin_lock_irqsave(&pcid_lock);
+    for (unsigned int i = 0; i < PCID_ROOTS; ++i) {
+        struct pcid_root *slot = &pcid_roots[i];
+        if (slot->users && slot->root == root && slot->pcid == pcid) {
+            if (--slot->users == 0)
+                bitmap_clear_range(pcid_used, pcid, 1);
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&pcid_lock, flags);
+}
+
+/* 中断已关，在switch_to_task之前调用。CR3不变时不写；PCID不过期时带CR3_NOFLUSH，保留它的TLB项。
+   没分到号的页表根借用PCID 0，载入时刷新，并让本CPU上启动页表的PCID 0过期 */
+void switch_mm(struct mm_struct *next) {
+    struct cpu *c = this_cpu();
+    uint64_t cr3 = next->cr3 | next->pcid;
+
+    if (pcid_enabled && (next->pcid != 0 || next->cr3 == kernel_root)) {
+        uint64_t *word = &pcid_stale[c->id][next->pcid / BITMAP_WORD_BITS];
+        uint64_t bit = (uint64_t)1 << (next->pcid % BITMAP_WORD_BITS);
+        if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+            __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+        else if (cr3 == c->cr3)
+            return;
+        else
+            cr3 |= CR3_NOFLUSH;
+    } else if (cr3 == c->cr3) {
+        return;
+    } else if (pcid_enabled) {
+        __atomic_fetch_or(&pcid_stale[c->id][0], (uint64_t)1, __ATOMIC_RELAXED);
+    }
+    write_cr3(cr3);
+    c->cr3 = cr3 & ~CR3_NOFLUSH;
+}
@@ -0,0 +1,22 @@
+#ifndef _PCID_H
+#define _PCID_H
+
+#include <stdint.h>
+
+/* CR4.PCIDE打开后CR3低12位是地址空间号（PCID），TLB项按PCID区分，
+   切换时置CR3_NOFLUSH不会冲掉别的地址空间的TLB项。PCID按页表根分配，启动时的页表用PCID 0；
+   目前所有任务共用启动时的页表，任务间切换不写CR3 */
+#define PCID_MAX                     4096
+#define CR3_PCID_MASK              0xfffUL
+#define CR3_ADDR_MASK   0x000ffffffffff000UL
+#define CR3_NOFLUSH              (1UL << 63)
+
+struct mm_struct;
+
+void pcid_init(void);
+void pcid_init_cpu(void);
+uint16_t pcid_get(uint64_t root);
+void pcid_put(uint64_t root, uint16_t pcid);
+void switch_mm(struct mm_struct *next);
+
+#endif
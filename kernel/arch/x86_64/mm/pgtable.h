@@ -10,6 +10,8 @@
 
 /* mpl4 */
 extern void *page_map_level4;
+/* pdptr，映射0~1GB（恒等）和内核所在的高2GB */
+extern void *kernel_page_directory_ptr;
 // /* pdptr */
 // extern void *first_page_directory_ptr; /* identity mapping pdtr */
 // extern void *last_page_directory_ptr;
@@ -0,0 +1,155 @@
+#include <stdint.h>
+#include <kernel/slab.h>
+#include <kernel/page.h>
+#include <kernel/printk.h>
+#include "pagemanager.h"
+
+#define SLAB_ALIGN                   sizeof(void*)
+#define SLAB_MIN_OBJS                8              /* 一个slab页至少放下的对象数 */
+
+/* slab头放在每个slab页的开头，空闲对象通过对象自身的前8字节串成单链表，因此对象没有额外的头部 */
+struct slab {
+    struct list_head list;
+    struct kmem_cache *cache;
+    struct page_alloc pa;
+    void *freelist;
+    unsigned int inuse;
+};
+
+static struct kmem_cache kmem_caches[KMEM_CACHE_MAX];
+static unsigned int kmem_cache_count = 0;
+static spinlock_t kmem_cache_list_lock = SPINLOCK_INIT;
+
+/* 对象所在的slab，slab页都是4k对齐的 */
+static struct slab *obj_to_slab(void *obj) {
+    return (struct slab*)((uintptr_t)obj & ~((uintptr_t)PAGE_SIZE - 1));
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj)) {
+    struct kmem_cache *cache = NULL;
+
+    if (size < sizeof(void*))
+        size = sizeof(void*);
+    size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    size_t offset = (sizeof(struct slab) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    if ((PAGE_SIZE - offset) / size < SLAB_MIN_OBJS) {
+        printk("kmem_cache_create: %s object too large\n", name);
+        return NULL;
+    }
+
+    unsigned long flags = spin_lock_irqsave(&kmem_cache_list_lock);
+    if (kmem_cache_count < KMEM_CACHE_MAX)
+        cache = &kmem_caches[kmem_cache_count++];
+    spin_unlock_irqrestore(&kmem_cache_list_lock, flags);
+    if (!cache)
+        return NULL;
+
+    cache->name = name;
+    cache->size = size;
+    cache->offset = offset;
+    cache->objs_per_slab = (PAGE_SIZE - offset) / size;
+    cache->ctor = ctor;
+    spin_lock_init(&cache->lock);
+    INIT_LIST_HEAD(&cache->slabs_partial);
+    INIT_LIST_HEAD(&cache->slabs_full);
+    INIT_LIST_HEAD(&cache->slabs_empty);
+    cache->nr_empty = 0;
+    cache->nr_slabs = 0;
+    cache->nr_active = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    return cache;
+}
+
+/* 申请一个新的slab页并把所有对象串到freelist上 */
+static struct slab *kmem_cache_grow(struct kmem_cache *cache) {
+    struct page_alloc pa = alloc_pages(1);
+    if (pa.page == 0)
+        return NULL;
+
+    struct slab *slab = (struct slab*)pa.page;
+    slab->cache = cache;
+    slab->pa = pa;
+    slab->inuse = 0;
+    slab->freelist = NULL;
+    char *obj = (char*)slab + cache->offset + (cache->objs_per_slab - 1) * cache->size;
+    for (unsigned int i = 0; i < cache->objs_per_slab; ++i) {
+        *(void**)obj = slab->freelist;
+        slab->freelist = obj;
+        obj -= cache->size;
+    }
+    cache->nr_slabs++;
+    return slab;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    struct slab *slab = NULL;
+    void *obj = NULL;
+
+    unsigned long flags = spin_lock_irqsave(&cache->lock);
+    /* 优先使用partial，其次empty，都没有时才申请新页 */
+    if (!list_empty(&cache->slabs_partial)) {
+        slab = container_of(cache->slabs_partial.next, struct slab, list);
+        cache->hits++;
+    } else if (!list_empty(&cache->slabs_empty)) {
+        slab = container_of(cache->slabs_empty.next, struct slab, list);
+        list_del(&slab->list);
+        list_add(&slab->list, &cache->slabs_partial);
+        cache->nr_empty--;
+        cache->hits++;
+    } else {
+        slab = kmem_cache_grow(cache);
+        if (!slab)
+            goto end;
+        list_add(&slab->list, &cache->slabs_partial);
+        cache->misses++;
+    }
+
+    obj = slab->freelist;
+    slab->freelist = *(void**)obj;
+    slab->inuse++;
+    cache->nr_active++;
+    if (slab->inuse == cache->objs_per_slab) {
+        list_del(&slab->list);
+        list_add(&slab->list, &cache->slabs_full);
+    }
+
+end:
+    spin_unlock_irqrestore(&cache->lock, flags);
+    if (obj && cache->ctor)
+        cache->ctor(obj);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    struct slab *slab = obj_to_slab(obj);
+
+    if (!obj)
+        return;
+    if (slab->cache != cache) {
+        printk("kmem_cache_free: object %x does not belong to %s\n", obj, cache->name);
+        return;
+    }
+
+    unsigned long flags = spin_lock_irqsave(&cache->lock);
+    *(void**)obj = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+    cache->nr_active--;
+
+    if (slab->inuse == 0) {
+        list_del(&slab->list);
+        if (cache->nr_empty < KMEM_CACHE_MAX_EMPTY) {
+            list_add(&slab->list, &cache->slabs_empty);
+            cache->nr_empty++;
+        } else {
+            cache->nr_slabs--;
+            free_pages(&slab->pa);
+        }
+    } else if (slab->inuse == cache->objs_per_slab - 1) {
+        /* full -> partial */
+        list_del(&slab->list);
+        list_add(&slab->list, &cache->slabs_partial);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
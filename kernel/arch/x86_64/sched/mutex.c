@@ -0,0 +1,199 @@
+#include "kernel/mutex.h"
+#include "kernel/slab.h"
+#include "../cpu/cpu.h"
+#include "task.h"
+
+#define MUTEX_SPIN_MAX            4096      /* 持有者一直在运行时最多自旋的次数，之后还是睡眠 */
+#define PI_CHAIN_MAX                 8      /* 沿blocked_on向下传递提升的最大深度 */
+
+static struct kmem_cache *mutex_cache = NULL;
+
+void mutex_init(struct mutex *m) {
+    m->owner = NULL;
+    m->nr_waiters = 0;
+    wait_queue_init(&m->wait);
+    m->pi_owner = NULL;
+    INIT_LIST_HEAD(&m->pi_node);
+    m->nr_spin_acquired = 0;
+    m->nr_slept = 0;
+}
+
+int mutex_trylock(struct mutex *m) {
+    struct thread_control_block *expected = NULL;
+    return __atomic_compare_exchange_n(&m->owner, &expected, current_task_TCB, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* 持有者正在某个CPU上运行，很可能马上就会释放，自旋比睡眠再被唤醒快得多；
+   持有者睡眠、被抢占或自旋太久时放弃，返回是否取得了锁 */
+static int mutex_optimistic_spin(struct mutex *m) {
+    for (unsigned int i = 0; i < MUTEX_SPIN_MAX; ++i) {
+        struct thread_control_block *owner = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+        if (!owner) {
+            if (mutex_trylock(m))
+                return 1;
+        } else if (__atomic_load_n(&owner->state, __ATOMIC_RELAXED) != RUNNING) {
+            return 0;
+        }
+        cpu_relax();
+    }
+    return 0;
+}
+
+/* 以下都由调用者持有lock_scheduler */
+
+/* 把m挂到持有者的pi_mutexes上；持有者换了时从旧持有者那里摘下，旧持有者解锁时会重新计算自己的优先级 */
+static void pi_link(struct mutex *m, struct thread_control_block *owner) {
+    if (m->pi_owner == owner)
+        return;
+    if (m->pi_owner)
+        list_del(&m->pi_node);
+    list_add(&m->pi_node, &owner->pi_mutexes);
+    m->pi_owner = owner;
+}
+
+static void pi_unlink(struct mutex *m) {
+    if (!m->pi_owner)
+        return;
+    list_del(&m->pi_node);
+    m->pi_owner = NULL;
+}
+
+/* 等待队列中排名最高的等待者，排名相同时取先来的 */
+static struct wait_queue_entry *mutex_top_waiter(struct mutex *m) {
+    struct wait_queue_entry *top = NULL;
+    struct list_head *p;
+    list_for_each(p, &m->wait.head) {
+        struct wait_queue_entry *w = container_of(p, struct wait_queue_entry, entry);
+        if (!top || task_rank(w->task) < task_rank(top->task))
+            top = w;
+    }
+    return top;
+}
+
+/* 重新计算task实际的优先级：基准优先级和它持有的mutex上所有等待者中最高的那个。
+   变化时沿着blocked_on传给它所等待的mutex的持有者，这样A等B、B等C时C也会被提升 */
+void pi_update_prio(struct thread_control_block *task) {
+    for (unsigned int depth = 0; task && depth < PI_CHAIN_MAX; ++depth) {
+        unsigned int rank = task->normal_policy == SCHED_PRIO ? task->normal_priority : NR_PRIO;
+        unsigned int base = rank;
+        struct list_head *p;
+        list_for_each(p, &task->pi_mutexes) {
+            struct wait_queue_entry *top = mutex_top_waiter(container_of(p, struct mutex, pi_node));
+            if (top && task_rank(top->task) < rank)
+                rank = task_rank(top->task);
+        }
+
+        policy_t policy = task->normal_policy;
+        unsigned int priority = task->normal_priority;
+        if (rank < base) {
+            policy = SCHED_PRIO;
+            priority = rank;
+        }
+        if (policy == task->policy && priority == task->priority)
+            return;
+        task_set_sched(task, policy, priority, task->weight);
+
+        struct mutex *next = task->blocked_on;
+        if (!next)
+            return;
+        task = __atomic_load_n(&next->owner, __ATOMIC_SEQ_CST);
+        if (task)
+            pi_link(next, task);
+    }
+}
+
+void mutex_lock(struct mutex *m) {
+    if (mutex_trylock(m))
+        return;
+    if (mutex_optimistic_spin(m)) {
+        m->nr_spin_acquired++;
+        return;
+    }
+
+    /* 先登记为等待者再重试：解锁者清owner之后读nr_waiters，两边至少有一个能看到对方 */
+    struct thread_control_block *self = current_task_TCB;
+    lock_scheduler();
+    __atomic_fetch_add(&m->nr_waiters, 1, __ATOMIC_SEQ_CST);
+    while (!mutex_trylock(m)) {
+        struct thread_control_block *owner = __atomic_load_n(&m->owner, __ATOMIC_SEQ_CST);
+        if (!owner)
+            continue;
+        struct wait_queue_entry wait;
+        m->nr_slept++;
+        self->blocked_on = m;
+        prepare_to_wait(&m->wait, &wait, 1);
+        pi_link(m, owner);
+        pi_update_prio(owner);
+        schedule();
+        self->blocked_on = NULL;
+    }
+    __atomic_fetch_sub(&m->nr_waiters, 1, __ATOMIC_SEQ_CST);
+    if (!list_empty(&m->wait.head)) {       /* 还有人在等，由新的持有者继承它们的优先级 */
+        pi_link(m, self);
+        pi_update_prio(self);
+    }
+    unlock_scheduler();
+}
+
+/* 先释放再唤醒排名最高的等待者：正在自旋的任务可以直接拿走锁，被唤醒的任务拿不到时重新睡眠。
+   释放后不再继承这个mutex上等待者的优先级 */
+void mutex_unlock(struct mutex *m) {
+    struct thread_control_block *self = current_task_TCB;
+    __atomic_store_n(&m->owner, NULL, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&m->nr_waiters, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    lock_scheduler();
+    if (m->pi_owner == self)
+        pi_unlink(m);
+    pi_update_prio(self);
+    struct wait_queue_entry *top = mutex_top_waiter(m);
+    if (top) {
+        list_del(&top->entry);
+        wake_up_task(top->task);
+    }
+    unlock_scheduler();
+}
+
+struct mutex* create_mutex(void) {
+    struct mutex *m;
+
+    if (!mutex_cache)
+        mutex_cache = kmem_cache_create("mutex", sizeof(struct mutex), NULL);
+    if (!mutex_cache)
+        return NULL;
+
+    m = (struct mutex*)kmem_cache_alloc(mutex_cache);
+    if (m != NULL)
+        mutex_init(m);
+    return m;
+}
+
+void acquire_mutex(struct mutex *m) {
+    mutex_lock(m);
+}
+
+void release_mutex(struct mutex *m) {
+    mutex_unlock(m);
+}
+
+void cond_init(struct condvar *cv) {
+    wait_queue_init(&cv->wait);
+}
+
+/* 调用者持有m；在调度器锁内释放m并挂到等待队列上，cond_signal不会落在两者之间。返回时重新持有m */
+void cond_wait(struct condvar *cv, struct mutex *m) {
+    lock_scheduler();
+    mutex_unlock(m);
+    wait_queue_sleep(&cv->wait, 1);
+    unlock_scheduler();
+    mutex_lock(m);
+}
+
+void cond_signal(struct condvar *cv) {
+    wake_up(&cv->wait, 1);
+}
+
+void cond_broadcast(struct condvar *cv) {
+    wake_up(&cv->wait, 0);
+}
@@ -0,0 +1,106 @@
+#include <kernel/spinlock.h>
+#include <kernel/wait.h>
+#include "../cpu/smp.h"
+#include "task.h"
+#include "rcu.h"
+
+/* 新登记的回调先进next，等上一个宽限期结束后整批移到wait并开始新的宽限期 */
+static spinlock_t rcu_lock = SPINLOCK_INIT;
+static struct rcu_head *rcu_next_list = NULL, **rcu_next_tail = &rcu_next_list;
+static struct rcu_head *rcu_wait_list = NULL;
+static int rcu_gp_active = 0;
+static unsigned long rcu_snap[NR_CPUS];             /* 宽限期开始时各CPU的rcu_qs */
+
+extern struct thread_control_block *kernel_clean_task;
+
+/* 调用者持有rcu_lock。开始宽限期的CPU此刻不在读临界区内，不用等它 */
+static void rcu_gp_start(void) {
+    unsigned int self = smp_processor_id();
+    for (unsigned int i = 0; i < NR_CPUS; ++i)
+        rcu_snap[i] = cpus[i].rcu_qs - (i == self);
+    rcu_gp_active = 1;
+}
+
+/* 调用者持有rcu_lock。每个在线CPU都经过了静止状态，或者正在idle；
+   本CPU正在执行这里，也不在读临界区内。tick停掉的CPU不会自己报告，用IPI打断它一下 */
+static int rcu_gp_done(void) {
+    unsigned int self = smp_processor_id();
+    int done = 1;
+    for (unsigned int i = 0; i < NR_CPUS; ++i) {
+        if (i == self || !cpus[i].online || cpus[i].rcu_qs != rcu_snap[i])
+            continue;
+        if (cpus[i].current == cpus[i].idle_task)
+            continue;
+        smp_send_resched(i);
+        done = 0;
+    }
+    return done;
+}
+
+/* 可以在中断中调用；func在宽限期之后由kernel_clean_task调用 */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+    head->func = func;
+    head->next = NULL;
+    unsigned long flags = spin_lock_irqsave(&rcu_lock);
+    *rcu_next_tail = head;
+    rcu_next_tail = &head->next;
+    spin_unlock_irqrestore(&rcu_lock, flags);
+    if (kernel_clean_task)
+        unblock_task(kernel_clean_task);
+}
+
+int rcu_pending(void) {
+    return __atomic_load_n(&rcu_next_list, __ATOMIC_RELAXED) || __atomic_load_n(&rcu_wait_list, __ATOMIC_RELAXED);
+}
+
+/* 在kernel_clean_work中调用：结束已经过去的宽限期并执行它的回调，有新的回调时开始下一个宽限期 */
+void rcu_process_callbacks(void) {
+    struct rcu_head *done = NULL;
+
+    unsigned long flags = spin_lock_irqsave(&rcu_lock);
+    if (rcu_gp_active && rcu_gp_done()) {
+        done = rcu_wait_list;
+        rcu_wait_list = NULL;
+        rcu_gp_active = 0;
+    }
+    if (!rcu_gp_active && rcu_next_list) {
+        rcu_wait_list = rcu_next_list;
+        rcu_next_list = NULL;
+        rcu_next_tail = &rcu_next_list;
+        rcu_gp_start();
+    }
+    spin_unlock_irqrestore(&rcu_lock, flags);
+
+    while (done) {
+        struct rcu_head *next = done->next;
+        done->func(done);
+        done = next;
+    }
+}
+
+struct rcu_synchronize {
+    struct rcu_head head;
+    struct wait_queue wait;
+    int done;
+};
+
+static void rcu_wakeme(struct rcu_head *head) {
+    struct rcu_synchronize *rs = container_of(head, struct rcu_synchronize, head);
+    lock_scheduler();
+    rs->done = 1;
+    wake_up_locked(&rs->wait, 0);
+    unlock_scheduler();
+}
+
+/* 等待一个完整的宽限期，只能在任务上下文中、读临界区之外调用 */
+void synchronize_rcu(void) {
+    struct rcu_synchronize rs;
+    rs.done = 0;
+    wait_queue_init(&rs.wait);
+    call_rcu(&rs.head, rcu_wakeme);
+
+    lock_scheduler();
+    while (!rs.done)
+        wait_queue_sleep(&rs.wait, 0);
+    unlock_scheduler();
+}
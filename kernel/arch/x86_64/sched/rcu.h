@@ -0,0 +1,45 @@
+#ifndef _RCU_H
+#define _RCU_H
+
+#include "../cpu/smp.h"
+#include "task.h"
+
+/*
+ * 读多写少的查找结构用RCU：读者只关抢占，不取任何锁；写者复制、修改后用rcu_assign_pointer换上新版本，
+ * 旧版本交给call_rcu，等所有CPU都经过一次静止状态（任务切换、idle、或在没关抢占时被中断）后再释放。
+ * 读临界区内不能睡眠。
+ */
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+#define rcu_dereference(p)          __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v)    __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+static inline void rcu_read_lock(void) {
+    preempt_disable();
+}
+
+static inline void rcu_read_unlock(void) {
+    preempt_enable();
+}
+
+/* 任务上下文中经过了静止状态 */
+static inline void rcu_note_qs(void) {
+    this_cpu()->rcu_qs++;
+}
+
+/* 中断中调用：被打断的代码没有关抢占，就不在读临界区内 */
+static inline void rcu_irq_qs(void) {
+    struct cpu *c = this_cpu();
+    if (c->preempt_count == 0)
+        c->rcu_qs++;
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void synchronize_rcu(void);
+int rcu_pending(void);
+void rcu_process_callbacks(void);
+
+#endif
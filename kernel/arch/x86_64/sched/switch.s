@@ -23,11 +23,15 @@ switch_to_task:
 
     call update_time_used
 
-    # load current_task_TCB->mm
-    mov current_task_TCB(%rip), %rsi
-    # set current task's state
+    # load current_task_TCB, kept in this cpu's data area (gs)
+    mov cpu_current_offset(%rip), %rcx
+    mov %gs:(%rcx), %rsi
+    # set current task's state, blocked tasks keep their reason
     mov TCB_state_offset(%rip), %rcx
-    mov $READY, (%rsi, %rcx, 1)
+    cmpl $RUNNING, (%rsi, %rcx, 1)
+    jne .doneState
+    movl $READY, (%rsi, %rcx, 1)
+.doneState:
 
     mov TCB_mm_offset(%rip), %rcx
     mov (%rsi, %rcx, 1), %rsi           # load mm into %rsi
@@ -37,10 +41,11 @@ switch_to_task:
     mov mm_rsp0_offset(%rip), %rcx
     mov %rsp, (%rsi, %rcx, 1)
     # load next task's state, next task saved in rdi
-    mov %rdi, current_task_TCB
+    mov cpu_current_offset(%rip), %rcx
+    mov %rdi, %gs:(%rcx)
 
     # set next task's state
-    mov current_task_TCB(%rip), %rsi
+    mov %rdi, %rsi
     mov TCB_state_offset(%rip), %rcx
     mov $RUNNING, (%rsi, %rcx, 1)
 
@@ -52,21 +57,14 @@ switch_to_task:
     mov mm_rsp0_offset(%rip), %rcx
     mov (%rsi, %rcx, 1), %rsp
     
-    # read cr3
-    mov mm_cr3_offset(%rip), %rcx
-    mov (%rsi, %rcx, 1), %rax
-
-    # save current_task_TCB->mm->tss_rsp0 to tss_rsp0
+    # save current_task_TCB->mm->tss_rsp0 to this cpu's tss
     mov mm_tss_rsp0_offset(%rip), %rcx
     mov (%rsi, %rcx, 1), %rcx
-    mov %rcx, tss_rsp0
-
-    # compare virtual address
-    mov %cr3, %rcx
-    cmpl %ecx, %eax
-    je .doneVAS
-    mov %rax, %cr3
-.doneVAS:
+    mov cpu_tss_rsp0_offset(%rip), %rdx
+    mov %gs:(%rdx), %rdx
+    mov %rcx, (%rdx)
+
+    # cr3 is switched by switch_mm before this call
 
 #.update_tss_rsp0:
     #mov %rsp, tss_rsp0
@@ -2,16 +2,31 @@
 #include "kernel/page.h"
 #include "kernel/timer.h"
 #include "kernel/malloc.h"
+#include "kernel/slab.h"
 #include "kernel/tty.h"
 #include <kernel/printk.h>
 #include <kernel/pic.h>
+#include <kernel/idt.h>
 #include "../include/defs.h"
 #include "../mm/mm.h"
 #include "../mm/pagemanager.h"
+#include "../mm/pcid.h"
 #include "../cpu/cpu.h"
+#include "../cpu/smp.h"
+#include "../cpu/apic.h"
+#include "../cpu/fpu.h"
 #include "task.h"
+#include "rcu.h"
 
 #define TIME_SLICE_LENGTH     200
+#define TASK_POOL_PREFILL       4              /* 初始化时预分配的任务栈数 */
+#define SCHED_LATENCY          20              /* fair调度类的目标延迟（tick），所有就绪任务在此期间内各运行一次 */
+#define SCHED_MIN_GRANULARITY   4              /* fair调度类的最小时间片（tick） */
+#define BALANCE_INTERVAL      100              /* 周期负载均衡的间隔（tick） */
+#define MIGRATION_COST          2              /* 这么多tick内运行过的任务认为cache还热，周期均衡不迁移它 */
+#define UTIL_SCALE           1024
+#define RCU_POLL_TICKS          2              /* kernel_clean_work检查宽限期的间隔 */
+#define WAKEUP_GRANULARITY   1000000L          /* ns，被唤醒的fair任务的vruntime要比当前任务小这么多才抢占，避免来回切换 */
 
 #define TCB_MEM_SIZE 1024
 static char tcb_mem[TCB_MEM_SIZE]; /* memory for tcb */
@@ -19,93 +34,528 @@ static char tcb_mem[TCB_MEM_SIZE]; /* memory for tcb */
 const uint64_t TCB_state_offset = offset_of(struct thread_control_block, state);
 const uint64_t TCB_mm_offset = offset_of(struct thread_control_block, mm);
 
-struct thread_control_block *current_task_TCB = NULL;
-struct list_head *ready_tcb_list = NULL;
+/*
+ * 锁：
+ *   lock_scheduler      全局，保护阻塞的任务链表、等待队列、mutex、信号量和优先级继承；不跨任务切换，
+ *                       schedule在切换前放开它，切回来后再取回
+ *   runqueues[i].lock   每个CPU的就绪队列一把，还保护该CPU的current、need_resched和队列中任务的state、cpu；
+ *                       切换时持有本CPU的队列锁，由下一个任务解锁。tick、IPI、idle和yield只取本CPU的这把
+ *   timer_lock          timer.c中，ktimer堆和PIT的tick状态
+ * 加锁顺序：lock_scheduler → 队列锁 → timer_lock。迁移、偷任务要同时持有两个队列锁，先锁CPU编号小的；
+ * 持有队列锁时不能再取lock_scheduler，所以唤醒都在lock_scheduler下进行，tick中先处理到期的定时器再锁队列。
+ * 队列锁都在关中断时取
+ */
+static struct run_queue runqueues[NR_CPUS];
+#define this_rq()       (&runqueues[smp_processor_id()])
+
+static inline void rq_lock(struct run_queue *q) {
+    ticket_lock(&q->lock);
+}
+
+static inline void rq_unlock(struct run_queue *q) {
+    ticket_unlock(&q->lock);
+}
+
+/* a和b不同 */
+static void double_rq_lock(struct run_queue *a, struct run_queue *b) {
+    if (a->cpu > b->cpu) {
+        struct run_queue *t = a;
+        a = b;
+        b = t;
+    }
+    rq_lock(a);
+    rq_lock(b);
+}
+
+static void double_rq_unlock(struct run_queue *a, struct run_queue *b) {
+    rq_unlock(a);
+    rq_unlock(b);
+}
+
+/* 锁住task所在CPU的队列；就绪的任务可能同时被迁走，锁上后cpu变了就重来 */
+static struct run_queue *task_rq_lock(struct thread_control_block *task) {
+    for (;;) {
+        struct run_queue *q = &runqueues[__atomic_load_n(&task->cpu, __ATOMIC_RELAXED)];
+        rq_lock(q);
+        if (task->cpu == q->cpu)
+            return q;
+        rq_unlock(q);
+    }
+}
+
+/* 正在hlt的CPU，别的CPU有多余的任务时用IPI叫醒其中一个来偷；NR_CPUS不能超过32 */
+static uint32_t idle_cpu_mask = 0;
+
 struct list_head *paused_task_list = NULL;
 struct list_head *sleeping_task_list = NULL;
 struct list_head *terminated_task_list = NULL;
-unsigned long last_count = 0;
 
-/* for task postpone */
-int postpone_task_switches_counter = 0;
-int task_switches_postponed_flag = 0;
+/* 每个优先级的时间片（tick），高优先级的任务多为交互任务，时间片短、响应快 */
+static const unsigned long prio_time_slice[NR_PRIO] = {
+    20, 40, 80, 120, TIME_SLICE_LENGTH, TIME_SLICE_LENGTH, 300, 400
+};
+
+static unsigned long sched_latency = SCHED_LATENCY;
+static unsigned long sched_min_granularity = SCHED_MIN_GRANULARITY;
+static unsigned int nr_tasks = 0;                 /* 所有任务数，fair堆的容量不能小于它 */
+
+static int fair_less(const struct heap_node *a, const struct heap_node *b) {
+    const struct thread_control_block *ta = container_of(a, struct thread_control_block, run_node);
+    const struct thread_control_block *tb = container_of(b, struct thread_control_block, run_node);
+    return (long)(ta->vruntime - tb->vruntime) < 0;
+}
+
+static void rq_init(struct run_queue *q, unsigned int cpu) {
+    ticket_lock_init(&q->lock);
+    for (unsigned int i = 0; i < NR_PRIO; ++i)
+        INIT_LIST_HEAD(&q->queue[i]);
+    q->bitmap = 0;
+    q->nr_running = 0;
+    q->cpu = cpu;
+    q->time_slice_remaining = 0;
+    q->last_count = get_timer_count();
+    q->last_clock = clock_ns();
+    q->busy = 0;
+    q->util = 0;
+    q->next_balance = q->last_count + BALANCE_INTERVAL;
+    q->nr_migrated = 0;
+    heap_init(&q->fair.heap, nr_tasks > TASK_POOL_PREFILL ? nr_tasks : TASK_POOL_PREFILL, fair_less);
+    q->fair.min_vruntime = 0;
+    q->fair.total_weight = 0;
+}
+
+static void kick_idle_cpu(struct run_queue *q);
+
+static void rq_enqueue(struct run_queue *q, struct thread_control_block *task) {
+    if (task->policy == SCHED_FAIR) {
+        heap_push(&q->fair.heap, &task->run_node);
+        q->fair.total_weight += task->weight;
+    } else {
+        list_add_tail(&task->tcb_list, &q->queue[task->priority]);
+        q->bitmap |= (uint32_t)1 << task->priority;
+    }
+    q->nr_running++;
+    if (q->cpu == smp_processor_id()) {
+        timer_tick_start();                 /* 不止一个可运行的任务，需要周期tick来轮转 */
+    } else {
+        __atomic_fetch_and(&idle_cpu_mask, ~((uint32_t)1 << q->cpu), __ATOMIC_RELAXED);
+        smp_send_resched(q->cpu);           /* 由目标CPU恢复它的tick，空闲时立即调度 */
+    }
+    kick_idle_cpu(q);
+}
+
+static void rq_dequeue(struct run_queue *q, struct thread_control_block *task) {
+    if (task->policy == SCHED_FAIR) {
+        heap_remove(&q->fair.heap, &task->run_node);
+        q->fair.total_weight -= task->weight;
+    } else {
+        list_del(&task->tcb_list);
+        if (list_empty(&q->queue[task->priority]))
+            q->bitmap &= ~((uint32_t)1 << task->priority);
+    }
+    q->nr_running--;
+}
+
+/* 新建或被唤醒的fair任务从min_vruntime附近开始，睡眠很久的任务最多获得半个目标延迟的补偿 */
+static void fair_place(struct run_queue *q, struct thread_control_block *task, int initial) {
+    unsigned long vruntime = q->fair.min_vruntime;
+    if (!initial)
+        vruntime -= sched_latency * NSEC_PER_TICK / 2;
+    if (initial || (long)(task->vruntime - vruntime) < 0)
+        task->vruntime = vruntime;
+}
+
+/* fair任务的时间片：按权重分得目标延迟，任务多时延长周期以保证最小时间片 */
+static unsigned long fair_slice(const struct run_queue *q, const struct thread_control_block *task) {
+    unsigned long nr = q->fair.heap.size + 1;
+    unsigned long period = sched_latency;
+    if (nr * sched_min_granularity > period)
+        period = nr * sched_min_granularity;
+    unsigned long slice = period * task->weight / (q->fair.total_weight + task->weight);
+    return slice < sched_min_granularity ? sched_min_granularity : slice;
+}
+
+/* 最高的非空优先级，队列为空时返回NR_PRIO */
+static unsigned int rq_top_prio(const struct run_queue *q) {
+    return q->bitmap ? (unsigned int)__builtin_ctz(q->bitmap) : NR_PRIO;
+}
+
+static struct thread_control_block *rq_pick(struct run_queue *q) {
+    struct thread_control_block *task = NULL;
+    unsigned int prio = rq_top_prio(q);
+    if (prio < NR_PRIO) {
+        task = container_of(q->queue[prio].next, struct thread_control_block, tcb_list);
+        q->time_slice_remaining = prio_time_slice[prio];
+    } else if (heap_top(&q->fair.heap)) {
+        task = container_of(heap_top(&q->fair.heap), struct thread_control_block, run_node);
+        if ((long)(task->vruntime - q->fair.min_vruntime) > 0)
+            q->fair.min_vruntime = task->vruntime;
+        rq_dequeue(q, task);
+        q->time_slice_remaining = fair_slice(q, task);
+        return task;
+    } else {
+        return NULL;
+    }
+    rq_dequeue(q, task);
+    return task;
+}
+
+static void rq_dump(const struct run_queue *q) {
+    printk("(");
+    for (unsigned int i = 0; i < NR_PRIO; ++i) {
+        struct list_head *p;
+        list_for_each(p, &q->queue[i])
+            printk("%u:%u ", (container_of(p, struct thread_control_block, tcb_list))->task_id, (unsigned long)i);
+    }
+    for (unsigned int i = 0; i < q->fair.heap.size; ++i) {
+        struct thread_control_block *task = container_of(q->fair.heap.nodes[i], struct thread_control_block, run_node);
+        printk("%u:f%u ", task->task_id, task->vruntime);
+    }
+    printk(") ");
+}
+
+/* tcb从slab cache分配，任务频繁创建/终止时不需要kmalloc */
+static struct kmem_cache *tcb_cache = NULL;
+
+static struct thread_control_block *tcb_alloc(void) {
+    return (struct thread_control_block *)kmem_cache_alloc(tcb_cache);
+}
+
+static void tcb_free(struct thread_control_block *task) {
+    kmem_cache_free(tcb_cache, task);
+}
+
+void task_pool_dump(void) {
+    printk("task pool: tcb %u/%u, mm %u/%u, stack %u/%u (hits/misses)\n",
+           tcb_cache->hits, tcb_cache->misses,
+           mm_cache->hits, mm_cache->misses,
+           stack_pool_stat.hits, stack_pool_stat.misses);
+}
+
+/* 新任务放到负载（就绪数加上正在运行的非idle任务）最轻的在线CPU上 */
+static unsigned int select_task_cpu(void) {
+    unsigned int best = smp_processor_id();
+    unsigned int best_load = (unsigned int)-1;
+    for (unsigned int i = 0; i < NR_CPUS; ++i) {
+        if (!cpus[i].online)
+            continue;
+        unsigned int load = runqueues[i].nr_running + (cpus[i].current != cpus[i].idle_task);
+        if (load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+/* 所有在线CPU的fair堆都要能放下nr个任务；调用者持有lock_scheduler，逐个锁住各队列 */
+static int rq_reserve_all(unsigned int nr) {
+    for (unsigned int i = 0; i < NR_CPUS; ++i) {
+        if (!cpus[i].online)
+            continue;
+        rq_lock(&runqueues[i]);
+        int ret = heap_reserve(&runqueues[i].fair.heap, nr);
+        rq_unlock(&runqueues[i]);
+        if (ret != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int is_idle_task(const struct thread_control_block *task) {
+    return task == cpus[task->cpu].idle_task;
+}
+
+/* 负载：就绪的任务数加上正在运行的非idle任务 */
+static unsigned int rq_load(unsigned int cpu) {
+    return runqueues[cpu].nr_running + (cpus[cpu].current != cpus[cpu].idle_task);
+}
+
+/* 本队列的任务多于一个时，叫醒一个空闲的CPU来偷 */
+static void kick_idle_cpu(struct run_queue *q) {
+    uint32_t mask = idle_cpu_mask & ~((uint32_t)1 << q->cpu);
+    if (!mask || rq_load(q->cpu) < 2)
+        return;
+    unsigned int cpu = __builtin_ctz(mask);
+    __atomic_fetch_and(&idle_cpu_mask, ~((uint32_t)1 << cpu), __ATOMIC_RELAXED);
+    smp_send_resched(cpu);
+}
+
+/* 以下两个不加锁读别的队列，只用来挑对象，锁上两个队列后调用者要重新确认 */
+/* 负载最重且有就绪任务可偷的其他在线CPU，负载相同时选利用率高的；没有时返回-1 */
+static int find_busiest_cpu(unsigned int self) {
+    int busiest = -1;
+    for (unsigned int i = 0; i < NR_CPUS; ++i) {
+        if (i == self || !cpus[i].online || runqueues[i].nr_running == 0)
+            continue;
+        if (busiest < 0 || rq_load(i) > rq_load(busiest) ||
+            (rq_load(i) == rq_load(busiest) && runqueues[i].util > runqueues[busiest].util))
+            busiest = i;
+    }
+    return busiest;
+}
+
+/* 负载最轻的其他在线CPU，负载相同时选利用率低的；没有时返回-1 */
+static int find_idlest_cpu(unsigned int self) {
+    int idlest = -1;
+    for (unsigned int i = 0; i < NR_CPUS; ++i) {
+        if (i == self || !cpus[i].online)
+            continue;
+        if (idlest < 0 || rq_load(i) < rq_load(idlest) ||
+            (rq_load(i) == rq_load(idlest) && runqueues[i].util < runqueues[idlest].util))
+            idlest = i;
+    }
+    return idlest;
+}
+
+static int task_cache_hot(const struct thread_control_block *task, unsigned long now) {
+    return now - task->last_ran < MIGRATION_COST;
+}
 
-/* for time accounting for task switching */
-unsigned long time_slice_remaining = 0;
+/* 从src中挑一个可以迁走的就绪任务：fair任务从vruntime最大的（在src上最晚才轮到的）开始，
+   再从低优先级到高优先级找；优先挑cache已经冷了的，allow_hot时没有冷的也可以。调用者持有src的锁 */
+static struct thread_control_block *pick_migratable(struct run_queue *src, int allow_hot) {
+    unsigned long now = get_timer_count();
+    struct thread_control_block *hot = NULL;
 
+    for (unsigned int i = src->fair.heap.size; i-- > 0; ) {
+        struct thread_control_block *task = container_of(src->fair.heap.nodes[i], struct thread_control_block, run_node);
+        if (!task_cache_hot(task, now))
+            return task;
+        if (!hot)
+            hot = task;
+    }
+    for (unsigned int prio = NR_PRIO; prio-- > 0; ) {
+        struct list_head *p;
+        list_for_each(p, &src->queue[prio]) {
+            struct thread_control_block *task = container_of(p, struct thread_control_block, tcb_list);
+            if (!task_cache_hot(task, now))
+                return task;
+            if (!hot)
+                hot = task;
+        }
+    }
+    return allow_hot ? hot : NULL;
+}
+
+/* 把就绪的task从src迁到dst，fair任务的vruntime按两个队列的min_vruntime换算，保持它在队列中的相对位置。
+   调用者用double_rq_lock锁住两个队列 */
+static void migrate_task(struct run_queue *src, struct run_queue *dst, struct thread_control_block *task) {
+    rq_dequeue(src, task);
+    if (task->policy == SCHED_FAIR)
+        task->vruntime = task->vruntime - src->fair.min_vruntime + dst->fair.min_vruntime;
+    task->cpu = dst->cpu;
+    dst->nr_migrated++;
+    rq_enqueue(dst, task);
+}
+
+/* 空闲的CPU从最忙的队列偷一个任务，cache热的也偷，总比空着好；返回是否偷到。不持有队列锁时调用 */
+static int idle_balance(struct run_queue *q) {
+    int src = find_busiest_cpu(q->cpu);
+    if (src < 0)
+        return 0;
+    struct run_queue *busiest = &runqueues[src];
+    struct thread_control_block *task = NULL;
+    double_rq_lock(q, busiest);
+    if (q->nr_running == 0)
+        task = pick_migratable(busiest, 1);
+    if (task)
+        migrate_task(busiest, q, task);
+    double_rq_unlock(q, busiest);
+    return task != NULL;
+}
+
+/* 每BALANCE_INTERVAL个tick调用一次：先用这段时间的运行时间更新利用率，
+   再与最忙/最闲的CPU比较，负载相差2个以上时拉一个或推一个cache冷的任务。不持有队列锁时调用 */
+static void periodic_balance(struct run_queue *q) {
+    rq_lock(q);
+    q->util = (q->util + q->busy * UTIL_SCALE / BALANCE_INTERVAL) / 2;
+    if (q->util > UTIL_SCALE)
+        q->util = UTIL_SCALE;
+    q->busy = 0;
+    rq_unlock(q);
+
+    struct thread_control_block *task = NULL;
+    int busiest = find_busiest_cpu(q->cpu);
+    if (busiest >= 0 && rq_load(busiest) >= rq_load(q->cpu) + 2) {
+        struct run_queue *src = &runqueues[busiest];
+        double_rq_lock(q, src);
+        if (rq_load(busiest) >= rq_load(q->cpu) + 2)
+            task = pick_migratable(src, 0);
+        if (task)
+            migrate_task(src, q, task);
+        double_rq_unlock(q, src);
+        return;
+    }
+
+    /* tick已停的CPU不会来拉，由忙的一方推过去 */
+    int idlest = find_idlest_cpu(q->cpu);
+    if (idlest >= 0 && q->nr_running && rq_load(q->cpu) >= rq_load(idlest) + 2) {
+        struct run_queue *dst = &runqueues[idlest];
+        double_rq_lock(q, dst);
+        if (rq_load(q->cpu) >= rq_load(idlest) + 2)
+            task = pick_migratable(q, 0);
+        if (task)
+            migrate_task(q, dst, task);
+        double_rq_unlock(q, dst);
+    }
+}
+
+/* 没有可运行的任务时先从别的CPU偷，偷不到再停掉周期tick并hlt，下一个定时器到期、IPI或其他中断时醒来；每个CPU各跑一个 */
+/* 检查之后别的CPU再往本队列放任务会发IPI，关着中断时它会挂起，到hlt时再响应 */
 void kernel_idle_work(void) {
     for(;;) {
-        size_t when = 0;
-        if (sleeping_task_list) {
-            struct thread_control_block *task = container_of(sleeping_task_list, struct thread_control_block, tcb_list);
-            when = task->sleep_expiry;
+        cli();
+        struct run_queue *q = this_rq();
+        if (q->nr_running == 0)
+            idle_balance(q);
+        rq_lock(q);
+        if (q->nr_running == 0) {
+            __atomic_fetch_or(&idle_cpu_mask, (uint32_t)1 << q->cpu, __ATOMIC_RELAXED);
+            timer_tick_stop(ktimer_next_deadline());
+            rq_unlock(q);
+            __asm__ volatile ("sti; hlt");      /* sti的下一条指令执行完才响应中断，不会错过唤醒 */
+        } else {
+            rq_unlock(q);
+            sti();
         }
 
+        __atomic_fetch_and(&idle_cpu_mask, ~((uint32_t)1 << q->cpu), __ATOMIC_RELAXED);
+        if (q->nr_running)
+            schedule();
+    }
+}
 
-        printk("idle work {%u %u} ", when, get_timer_count());
-        printk("(");
-        if (ready_tcb_list) {
-            struct list_head *p = ready_tcb_list;
-            do {
-                printk("%u ", (container_of(p, struct thread_control_block, tcb_list))->task_id);
-                p = p->next;
-            } while (p != ready_tcb_list);
-        }
-        printk(") ");
+void sched_dump(void) {
+    unsigned long flags = irq_save();
+    printk("sched {%u %u} ", ktimer_next_deadline(), get_timer_count());
+    for (unsigned int i = 0; i < NR_CPUS; ++i) {
+        if (!cpus[i].online)
+            continue;
+        rq_lock(&runqueues[i]);
+        printk("cpu%u load %u util %u migrated %u ", (unsigned long)i, (unsigned long)rq_load(i),
+               runqueues[i].util, runqueues[i].nr_migrated);
+        rq_dump(&runqueues[i]);
+        rq_unlock(&runqueues[i]);
+    }
+    irq_restore(flags);
+    task_pool_dump();
+}
 
-        for (unsigned long i=0; i<300000000; ++i);
-        // lock_scheduler();
-        // schedule();
-        // unlock_scheduler();
+/* 终止的任务在放开lock_scheduler之后才去锁队列、切走，要等它所在的CPU切换完（队列锁被下一个任务放开）才能释放它的栈 */
+static void wait_task_off_cpu(struct thread_control_block *task) {
+    for (;;) {
+        unsigned long flags = irq_save();
+        struct run_queue *q = &runqueues[task->cpu];
+        rq_lock(q);
+        int on_cpu = (cpus[q->cpu].current == task);
+        rq_unlock(q);
+        irq_restore(flags);
+        if (!on_cpu)
+            return;
+        cpu_relax();
     }
 }
-struct thread_control_block *kernel_idle_task = NULL;
 
+/* 回收终止的任务，执行宽限期已过的RCU回调；还有RCU回调在等时隔RCU_POLL_TICKS再看，否则暂停到被唤醒 */
 void kernel_clean_work(void) {
     struct thread_control_block *task = NULL;
-    lock_stuff();
+    for (;;) {
+        /* 每次从链表上取下一个，在锁外等它切走并释放 */
+        lock_stuff();
+        task = NULL;
+        if (terminated_task_list != NULL) {
+            task = container_of(terminated_task_list, struct thread_control_block, tcb_list);
+            if (terminated_task_list == terminated_task_list->next)
+                terminated_task_list = NULL;
+            else {
+                terminated_task_list = terminated_task_list->next;
+                list_del(&task->tcb_list);
+            }
+            nr_tasks--;
+        }
+        unlock_stuff();
+        if (task) {
+            wait_task_off_cpu(task);
+            printk("task %u terminated\n", task->task_id);
+            ktimer_destroy(&task->sleep_timer);
+            fpu_release(task);
+            mm_clean(task->mm);
+            mm_free(task->mm);
+            tcb_free(task);
+            continue;
+        }
 
-    while (terminated_task_list != NULL) {
-        task = container_of(terminated_task_list, struct thread_control_block, tcb_list);
-        if (terminated_task_list == terminated_task_list->next)
-            terminated_task_list = NULL;
-        else {
-            terminated_task_list = terminated_task_list->next;
-            list_del(&task->tcb_list);
+        rcu_process_callbacks();
+
+        if (rcu_pending()) {
+            nano_sleep_until(get_timer_count() + RCU_POLL_TICKS);
+            continue;
         }
-        printk("task %u terminated\n", task->task_id);
-        mm_clean(task->mm);
-        kfree(task);
+        lock_stuff();
+        if (terminated_task_list == NULL && !rcu_pending())
+            block_task(PAUSED);
+        unlock_stuff();
     }
-    block_task(PAUSED);
-    unlock_stuff();
 }
 struct thread_control_block *kernel_clean_task = NULL;
 
+static void sleep_timer_expired(struct ktimer *timer __attribute__((unused)), void *data) {
+    unblock_task((struct thread_control_block *)data);
+}
+
+/* 新任务第一次被切换到时从这里开始，持有切换时本CPU的队列锁；新任务总是开着中断运行 */
 static void task_start_up() {
-    unlock_scheduler();
+    rq_unlock(this_rq());
+    sti();
+}
+
+/* 把当前的执行流作为本CPU的idle任务，它使用启动时的栈，不在任何就绪队列中 */
+static void idle_task_init(void) {
+    struct thread_control_block *idle = tcb_alloc();
+    idle->mm = mm_alloc();
+    idle->task_id = 0;
+    idle->mm->rsp0 = 0;
+    idle->mm->rsp =  0;
+    idle->mm->cr3 = getcr3() & CR3_ADDR_MASK;
+    idle->mm->pcid = 0;
+    idle->state = RUNNING;
+    idle->time_used = 0;
+    idle->last_ran = 0;
+    idle->priority = NR_PRIO - 1;
+    idle->cpu = smp_processor_id();
+    idle->policy = SCHED_PRIO;
+    idle->normal_priority = idle->priority;
+    idle->normal_policy = idle->policy;
+    idle->blocked_on = NULL;
+    INIT_LIST_HEAD(&idle->pi_mutexes);
+    idle->fpu_state = NULL;
+    idle->fpu_cpu = NR_CPUS;
+    idle->weight = NICE_0_WEIGHT;
+    idle->vruntime = 0;
+    heap_node_init(&idle->run_node);
+    this_cpu()->idle_task = idle;
+    this_cpu()->current = idle;
 }
 
 void init_scheduler(void) {
 
     /* init task */
     kmemory_init(tcb_mem,TCB_MEM_SIZE);
-    kernel_idle_task = (struct thread_control_block*)kmalloc(sizeof(struct thread_control_block));
-    kernel_idle_task->mm = (struct mm_struct*)kmalloc(sizeof(struct mm_struct));
-    kernel_idle_task->task_id = 0;
-    kernel_idle_task->mm->rsp0 = 0;
-    kernel_idle_task->mm->rsp =  0;
-    kernel_idle_task->mm->cr3 = getcr3();
-    kernel_idle_task->state = RUNNING;
-    kernel_idle_task->time_used = 0;
-    current_task_TCB = kernel_idle_task;
-    last_count = get_timer_count();
-    time_slice_remaining = TIME_SLICE_LENGTH;
+    fpu_init(FPU_MODE_AUTO);
+    pcid_init();
+    tcb_cache = kmem_cache_create("tcb", sizeof(struct thread_control_block), NULL);
+    mm_pool_init(TASK_POOL_PREFILL);
+    rq_init(this_rq(), smp_processor_id());
+    idle_task_init();
+    this_rq()->time_slice_remaining = TIME_SLICE_LENGTH;
 
     kernel_clean_task = create_task(kernel_clean_work);
-    ready_tcb_list = NULL;
+    rq_dequeue(&runqueues[kernel_clean_task->cpu], kernel_clean_task);
+    kernel_clean_task->state = PAUSED;             /* 放在paused_task_list上，unblock_task才会唤醒它 */
     paused_task_list = &kernel_clean_task->tcb_list;
     INIT_LIST_HEAD(paused_task_list);
+    kmcheck_init();
 }
 
 #define PUSH_STACK(s, v) \
@@ -114,18 +564,18 @@ struct thread_control_block *create_task(void (*ent)) {
         static unsigned long task_id_counter = 0;
 
         /* alloc new tcb mem */
-        struct thread_control_block *new_task = (struct thread_control_block *)kmalloc(sizeof(struct thread_control_block));
+        struct thread_control_block *new_task = tcb_alloc();
         if (!new_task)
             return 0;
 
-        new_task->mm = (struct mm_struct *)kmalloc(sizeof(struct mm_struct));
+        new_task->mm = mm_alloc();
         if (!new_task->mm) {
-            kfree(new_task);
+            tcb_free(new_task);
             return 0;
         }
         if (mm_init(new_task->mm) != 0) {
-            kfree(new_task->mm);
-            kfree(new_task);
+            mm_free(new_task->mm);
+            tcb_free(new_task);
             return 0;
         }
 
@@ -133,6 +583,23 @@ struct thread_control_block *create_task(void (*ent)) {
         new_task->task_id = ++task_id_counter;
         new_task->state = READY;
         new_task->time_used = 0;
+        new_task->last_ran = 0;
+        new_task->priority = DEFAULT_PRIO;
+        new_task->policy = SCHED_FAIR;
+        new_task->normal_priority = new_task->priority;
+        new_task->normal_policy = new_task->policy;
+        new_task->blocked_on = NULL;
+        INIT_LIST_HEAD(&new_task->pi_mutexes);
+        new_task->fpu_state = NULL;
+        new_task->fpu_cpu = NR_CPUS;
+        if (ktimer_init(&new_task->sleep_timer, sleep_timer_expired, new_task) != 0) {
+            mm_clean(new_task->mm);
+            mm_free(new_task->mm);
+            tcb_free(new_task);
+            return 0;
+        }
+        new_task->weight = NICE_0_WEIGHT;
+        heap_node_init(&new_task->run_node);
 
         /* init stack */
         PUSH_STACK(new_task->mm->rsp0, ent); /* ret function */
@@ -142,68 +609,152 @@ struct thread_control_block *create_task(void (*ent)) {
         PUSH_STACK(new_task->mm->rsp0, 0);   /* rcx */
         PUSH_STACK(new_task->mm->rsp0, 0);   /* rsi */
 
-        /* add to ready list */
-        if (!ready_tcb_list) {
-            ready_tcb_list = &(new_task->tcb_list);
-            INIT_LIST_HEAD(ready_tcb_list);
-        } else {
-            list_add_tail(&new_task->tcb_list, ready_tcb_list);
+        /* add to ready list，每个CPU的fair堆都要能放下所有任务，因为唤醒可能发生在中断中，那时不能扩容 */
+        lock_scheduler();
+        if (rq_reserve_all(nr_tasks + 1) != 0) {
+            unlock_scheduler();
+            ktimer_destroy(&new_task->sleep_timer);
+            mm_clean(new_task->mm);
+            mm_free(new_task->mm);
+            tcb_free(new_task);
+            return 0;
         }
+        nr_tasks++;
+        struct run_queue *q = &runqueues[select_task_cpu()];
+        new_task->cpu = q->cpu;
+        rq_lock(q);
+        fair_place(q, new_task, 1);
+        rq_enqueue(q, new_task);
+        rq_unlock(q);
+        unlock_scheduler();
         return new_task;
 }
 
-void schedule() {
-    if (postpone_task_switches_counter != 0) {
-        /* 此处流程通常是因为之前调用了lock_stuff，此处会跳过当前schedule，推迟到unblock_stuff中的schedule */
-        /* 此处目的是上下文切换与调度的分离 */
-        task_switches_postponed_flag = 1;
-        return;
-    }
+/* AP上线时调用，调用者持有lock_scheduler */
+void sched_init_ap(void) {
+    rq_init(this_rq(), smp_processor_id());
+    idle_task_init();
+}
+
+/* 带着本CPU的队列锁切换，由下一个任务解锁 */
+static void context_switch(struct thread_control_block *next) {
+    rcu_note_qs();                          /* 能切换说明没有关抢占，不在读临界区内 */
+    switch_mm(next->mm);
+    fpu_switch(current_task_TCB, next);
+    switch_to_task(next);
+}
 
-    if (ready_tcb_list) {
-        if (current_task_TCB->state == RUNNING && current_task_TCB != kernel_idle_task) {
+/* 调用者持有本CPU的队列锁，没有持有lock_scheduler */
+static void __schedule(void) {
+    struct cpu *c = this_cpu();
+    struct run_queue *q = &runqueues[c->id];
+    c->need_resched = 0;
+
+    if (q->nr_running) {
+        /* 先记账，当前任务以最新的vruntime放回堆中 */
+        update_time_used();
+        if (current_task_TCB->state == RUNNING && current_task_TCB != c->idle_task) {
             current_task_TCB->state = READY;
-            list_add_tail(&current_task_TCB->tcb_list, ready_tcb_list);
+            rq_enqueue(q, current_task_TCB);
         }
-        struct thread_control_block *next_task = container_of(ready_tcb_list, struct thread_control_block, tcb_list);
+        struct thread_control_block *next_task = rq_pick(q);
         next_task->state = RUNNING;
-        if (ready_tcb_list->next == ready_tcb_list)
-            ready_tcb_list = NULL;
-        else
-            ready_tcb_list = ready_tcb_list->next;
-        list_del(&next_task->tcb_list);
-        time_slice_remaining = TIME_SLICE_LENGTH;
-        switch_to_task(next_task);
+        if (next_task != current_task_TCB)
+            context_switch(next_task);
     } else {
         if (current_task_TCB->state == RUNNING)
             return;
         // terminal_writestring("No tasks to switch!");
         // while (1);
-        time_slice_remaining = 0;
-        switch_to_task(kernel_idle_task);
+        q->time_slice_remaining = 0;
+        context_switch(c->idle_task);
     }
 
 }
 
 void update_time_used(void) {
+    struct run_queue *q = this_rq();
     unsigned long current_count = get_timer_count();
-    unsigned long elapsed = current_count - last_count;
-    last_count = current_count;
-    current_task_TCB->time_used += elapsed;
+    unsigned long elapsed = current_count - q->last_count;
+    unsigned long now = clock_ns();
+    unsigned long elapsed_ns = now - q->last_clock;
+    q->last_count = current_count;
+    q->last_clock = now;
+    current_task_TCB->time_used += elapsed_ns;
+    current_task_TCB->last_ran = current_count;
+    if (current_task_TCB != this_cpu()->idle_task)
+        q->busy += elapsed;
+    if (current_task_TCB->policy == SCHED_FAIR)
+        current_task_TCB->vruntime += elapsed_ns * NICE_0_WEIGHT / current_task_TCB->weight;
+}
+
+/* lock_scheduler：关中断的MCS锁，各CPU在自己数据区的节点上排队。锁属于CPU而不是任务，同一CPU上可以嵌套；
+   持锁期间本CPU不响应任何中断。保护的范围和加锁顺序见文件开头，就绪队列不归它管 */
+static mcs_lock_t sched_lock = MCS_LOCK_INIT;
+
+/* schedule切换前完全放开lock_scheduler，返回原来的嵌套层数，*flags为最外层加锁前的rflags */
+static int sched_lock_drop(unsigned long *flags) {
+    struct cpu *c = this_cpu();
+    int depth = c->lock_depth;
+    if (depth) {
+        *flags = c->sched_irq_flags;
+        c->lock_depth = 0;
+        mcs_unlock(&sched_lock, &c->sched_node);
+    }
+    return depth;
+}
+
+/* 切回来后（可能已在别的CPU上）按原来的层数取回 */
+static void sched_lock_retake(int depth, unsigned long flags) {
+    if (!depth)
+        return;
+    struct cpu *c = this_cpu();
+    mcs_lock(&sched_lock, &c->sched_node);
+    c->lock_depth = depth;
+    c->sched_irq_flags = flags;
+}
+
+/* 持有lock_scheduler时也可以调用：阻塞的任务已经挂在链表或等待队列上，放开锁之后就可能被唤醒，
+   这时它还是本CPU的current，唤醒的一方只把它改回RUNNING，__schedule会接着运行它 */
+void schedule() {
+    unsigned long flags = irq_save();
+    struct cpu *c = this_cpu();
+    if (c->preempt_count != 0) {
+        /* 此处流程通常是因为之前调用了lock_stuff，此处会跳过当前schedule，推迟到unblock_stuff中的schedule */
+        /* 此处目的是上下文切换与调度的分离 */
+        c->resched_postponed = 1;
+        irq_restore(flags);
+        return;
+    }
+    unsigned long sched_flags = 0;
+    int depth = sched_lock_drop(&sched_flags);
+    rq_lock(this_rq());
+    __schedule();
+    rq_unlock(this_rq());                   /* 切回来时可能已在别的CPU上 */
+    sched_lock_retake(depth, sched_flags);
+    irq_restore(flags);
 }
 
-int irq_disable_counter = 0;
 void lock_scheduler() {
-    // cli();
-    IRQ_set_mask(0);
-    irq_disable_counter++;
+    unsigned long flags = irq_save();
+    struct cpu *c = this_cpu();
+    if (c->lock_depth++ == 0) {
+        mcs_lock(&sched_lock, &c->sched_node);
+        c->sched_irq_flags = flags;
+    }
 }
 
+/* 最外层解锁时处理唤醒抢占；只在加锁前开着中断时做，这样不会在中断处理程序中途切换 */
 void unlock_scheduler() {
-    irq_disable_counter--;
-    if (irq_disable_counter == 0) {
-        // sti();
-        IRQ_clear_mask(0);
+    struct cpu *c = this_cpu();
+    if (c->lock_depth == 1 && c->need_resched && c->preempt_count == 0 && (c->sched_irq_flags & RFLAGS_IF)) {
+        schedule();
+        c = this_cpu();                     /* 切回来时可能已在别的CPU上 */
+    }
+    if (--c->lock_depth == 0) {
+        unsigned long flags = c->sched_irq_flags;
+        mcs_unlock(&sched_lock, &c->sched_node);
+        irq_restore(flags);
     }
 }
 
@@ -227,8 +778,6 @@ void block_task(state_t reason) {
     case TERMINATED:         /* 被终止的任务 */
         current_task_list = &terminated_task_list;
         break;
-    case WAITING_FOR_LOCK:
-        break;
     default:
         unlock_scheduler();
         return;
@@ -246,8 +795,47 @@ void block_task(state_t reason) {
     unlock_scheduler();
 }
 
+/* 把阻塞的任务放回它最后运行的CPU的就绪队列，调用者持有lock_scheduler */
+/* 被唤醒的任务是否应立即抢占q上正在运行的任务：排名更高，或同为fair任务而vruntime小得多 */
+static int wakeup_preempt(struct run_queue *q, struct thread_control_block *task) {
+    struct thread_control_block *curr = cpus[q->cpu].current;
+    if (curr == cpus[q->cpu].idle_task)
+        return 1;
+    if (task_rank(task) != task_rank(curr))
+        return task_rank(task) < task_rank(curr);
+    return task->policy == SCHED_FAIR && (long)(curr->vruntime - task->vruntime) > WAKEUP_GRANULARITY;
+}
+
+/* 需要抢占时只做标记：本CPU在最外层unlock_scheduler或下一个tick时切换，别的CPU由rq_enqueue发的IPI切换 */
+/* 任务还没来得及切走时（见schedule）只把它改回RUNNING */
+static void task_make_ready(struct thread_control_block *task) {
+    struct run_queue *q = task_rq_lock(task);
+    if (cpus[q->cpu].current == task) {
+        task->state = RUNNING;
+    } else {
+        task->state = READY;
+        if (task->policy == SCHED_FAIR)
+            fair_place(q, task, 0);
+        rq_enqueue(q, task);
+        if (wakeup_preempt(q, task))
+            cpus[q->cpu].need_resched = 1;
+    }
+    rq_unlock(q);
+}
+
+/* 唤醒在wait_queue上睡眠的任务，由wake_up_locked调用，调用者持有lock_scheduler */
+void wake_up_task(struct thread_control_block *task) {
+    if (task->state == WAITING)
+        task_make_ready(task);
+}
+
+/* 只处理PAUSED和SLEEPING的任务，在wait_queue上睡眠的任务由wake_up唤醒 */
 void unblock_task(struct thread_control_block *task) {
     lock_scheduler();
+    if (task->state != PAUSED && task->state != SLEEPING) {
+        unlock_scheduler();
+        return;
+    }
 
     /* traverse these blocked list */
     struct list_head **blocked_lists[] = {&sleeping_task_list, &paused_task_list};
@@ -260,42 +848,101 @@ void unblock_task(struct thread_control_block *task) {
         }
     }
 
+    if (task->state == SLEEPING)                            /* 提前被唤醒 */
+        ktimer_cancel(&task->sleep_timer);
     list_del(&task->tcb_list);
-    task->state = READY;
-    if (ready_tcb_list) {
-        list_add_tail(&task->tcb_list, ready_tcb_list);
-    } else {
-        ready_tcb_list = &task->tcb_list;
-        INIT_LIST_HEAD(ready_tcb_list);
-    }
+    task_make_ready(task);
+    unlock_scheduler();
+}
+
+/* 调用者持有lock_scheduler：修改任务实际使用的调度类和参数，就绪的任务会移到新的队列 */
+void task_set_sched(struct thread_control_block *task, policy_t policy, unsigned int priority, unsigned long weight) {
+    struct run_queue *q = task_rq_lock(task);
+    int queued = (task->state == READY);
+    if (queued)
+        rq_dequeue(q, task);
+    if (policy == SCHED_FAIR && task->policy != SCHED_FAIR)
+        fair_place(q, task, 1);
+    task->policy = policy;
+    task->priority = priority;
+    task->weight = weight;
+    if (queued)
+        rq_enqueue(q, task);
+    rq_unlock(q);
+}
+
+/* 把任务放进SCHED_PRIO调度类；优先级高于当前任务时在下一个tick抢占。
+   任务因优先级继承被提升时只改基准优先级，释放完锁后才生效 */
+int set_task_priority(struct thread_control_block *task, unsigned int priority) {
+    if (priority >= NR_PRIO || is_idle_task(task))
+        return -1;
+    lock_scheduler();
+    task->normal_policy = SCHED_PRIO;
+    task->normal_priority = priority;
+    pi_update_prio(task);
+    unlock_scheduler();
+    return 0;
+}
+
+/* 把任务放进SCHED_FAIR调度类，CPU份额与weight成正比 */
+int set_task_weight(struct thread_control_block *task, unsigned long weight) {
+    if (weight == 0 || is_idle_task(task))
+        return -1;
+    lock_scheduler();
+    task->normal_policy = SCHED_FAIR;
+    task_set_sched(task, task->policy, task->priority, weight);
+    pi_update_prio(task);
+    unlock_scheduler();
+    return 0;
+}
+
+/* 设置fair调度类的目标延迟和最小时间片，单位为tick */
+int sched_set_latency(unsigned long target_latency, unsigned long min_granularity) {
+    if (min_granularity == 0 || target_latency < min_granularity)
+        return -1;
+    lock_scheduler();
+    sched_latency = target_latency;
+    sched_min_granularity = min_granularity;
     unlock_scheduler();
+    return 0;
 }
 
 void lock_stuff(void) {
-#ifndef SMP
-    // cli();
-    IRQ_set_mask(0);
-    irq_disable_counter++;
-    postpone_task_switches_counter++;
-#endif
+    lock_scheduler();
+    this_cpu()->preempt_count++;
 }
 
 void unlock_stuff(void) {
-#ifndef SMP
-    postpone_task_switches_counter--;
-    if (postpone_task_switches_counter == 0) {
-        if (task_switches_postponed_flag != 0) {
-            task_switches_postponed_flag = 0;
+    struct cpu *c = this_cpu();
+    c->preempt_count--;
+    if (c->preempt_count == 0) {
+        if (c->resched_postponed != 0) {
+            c->resched_postponed = 0;
             schedule();
         }
     }
+    unlock_scheduler();
+}
 
-    irq_disable_counter--;
-    if (irq_disable_counter == 0) {
-        // sti();
-        IRQ_clear_mask(0);
+/* 只推迟任务切换，不屏蔽中断；推迟期间到期的切换在preempt_enable中补上 */
+/* 计数在本CPU的数据区中，用一条gs前缀的指令修改，不会被中断打断到一半 */
+void preempt_disable(void) {
+    __asm__ volatile ("incl %%gs:%c0" : : "i"(__builtin_offsetof(struct cpu, preempt_count)) : "memory");
+}
+
+void preempt_enable(void) {
+    __asm__ volatile ("decl %%gs:%c0" : : "i"(__builtin_offsetof(struct cpu, preempt_count)) : "memory");
+    struct cpu *c = this_cpu();
+    if (c->preempt_count == 0 && (c->resched_postponed || c->need_resched)) {
+        unsigned long flags = irq_save();
+        c = this_cpu();
+        /* 唤醒抢占和unlock_scheduler一样，只在开着中断时做 */
+        if (c->preempt_count == 0 && (c->resched_postponed || (c->need_resched && (flags & RFLAGS_IF)))) {
+            c->resched_postponed = 0;
+            schedule();
+        }
+        irq_restore(flags);
     }
-#endif
 }
 
 void nano_sleep_until(uint64_t when) {
@@ -306,11 +953,39 @@ void nano_sleep_until(uint64_t when) {
         unlock_stuff();
         return;
     }
-    current_task_TCB->sleep_expiry = when;
+    ktimer_start(&current_task_TCB->sleep_timer, when, 0);
     block_task(SLEEPING);
     unlock_stuff();
 }
 
+/* 睡眠ns纳秒：整tick的部分阻塞等待，剩下不足一个tick的零头忙等 */
+void nano_sleep(unsigned long ns) {
+    unsigned long end = clock_ns() + ns;
+    if (ns >= NSEC_PER_TICK)
+        nano_sleep_until(get_timer_count() + ns / NSEC_PER_TICK);
+    long left = (long)(end - clock_ns());
+    if (left > 0)
+        clock_delay_ns(left);
+}
+
+/* 主动让出CPU：fair任务排到堆中最小的vruntime之后，SCHED_PRIO任务排到同优先级的队尾。
+   没有同等或更高排名的就绪任务时继续运行 */
+void yield(void) {
+    unsigned long flags = irq_save();
+    struct run_queue *q = this_rq();
+    rq_lock(q);
+    struct thread_control_block *curr = current_task_TCB;
+    struct heap_node *top = heap_top(&q->fair.heap);
+    if (curr->policy == SCHED_FAIR && top) {
+        struct thread_control_block *first = container_of(top, struct thread_control_block, run_node);
+        if ((long)(curr->vruntime - first->vruntime) <= 0)
+            curr->vruntime = first->vruntime + 1;
+    }
+    rq_unlock(q);
+    schedule();
+    irq_restore(flags);
+}
+
 void terminate_task(void) {
     lock_stuff();
     unblock_task(kernel_clean_task);
@@ -320,35 +995,54 @@ void terminate_task(void) {
 
 // 定义一个函数，用于定时器处理程序中的任务钩子
 void task_hook_in_timer_handler(void) {
-    lock_scheduler();
-
-    if (sleeping_task_list) {
-        struct list_head *anchor_task_list = sleeping_task_list;
-        do {
-            struct thread_control_block *task = container_of(sleeping_task_list, struct thread_control_block, tcb_list);
-            while (task->sleep_expiry <= get_timer_count()) {
-                unblock_task(task);
-                if (!sleeping_task_list) break;
-                task = container_of(sleeping_task_list, struct thread_control_block, tcb_list);
-                anchor_task_list = sleeping_task_list;
-            }
-            /* 到此处可以判断当前的sleeping_task_list时间未到 */
-
-            if (!sleeping_task_list) break;
-            sleeping_task_list = sleeping_task_list->next;
+    rcu_irq_qs();
+    struct run_queue *q = this_rq();
+    int resched = 0;
 
-        } while(anchor_task_list != sleeping_task_list); 
+    /* 定时器都在BSP上处理，休眠的任务由它们的sleep_timer唤醒；回调要取lock_scheduler，在锁队列之前做 */
+    if (q->cpu == 0)
+        timer_tick();
 
+    unsigned long now = get_timer_count();
+    if ((long)(now - q->next_balance) >= 0) {
+        q->next_balance = now + BALANCE_INTERVAL;
+        periodic_balance(q);
     }
 
-    if (ready_tcb_list) {
-        if (time_slice_remaining <=1)
-            /* 首次schedule，对应下一个任务的start_up会执行unlock_scheduler */
-            /* 之后的其他次切换，执行的都是下文中的unlock_scheduler */
-            schedule();
+    rq_lock(q);
+    if (q->nr_running) {
+        /* 有更高优先级的任务就绪时不等时间片用完 */
+        if (q->time_slice_remaining <=1 || this_cpu()->need_resched || rq_top_prio(q) < task_rank(current_task_TCB))
+            resched = 1;
         else
-            time_slice_remaining--;
+            q->time_slice_remaining--;
+    } else {
+        /* 只有当前任务可运行，不需要周期tick */
+        timer_tick_stop(ktimer_next_deadline());
     }
+    rq_unlock(q);
 
-    unlock_scheduler();
+    /* 首次切换到的新任务在task_start_up中解开队列锁，其他的在schedule中 */
+    if (resched)
+        schedule();
+}
+
+/* 别的CPU往本CPU的队列放了任务：恢复tick；本CPU空闲或来了更高优先级的任务时立即调度 */
+/* 持有队列锁时中断是关的，IPI不会打断本CPU的临界区 */
+void resched_ipi_handler(void) {
+    lapic_eoi();
+    rcu_irq_qs();                           /* 宽限期迟迟不结束时也会收到这个IPI */
+    struct cpu *c = this_cpu();
+    int resched = 0;
+
+    struct run_queue *q = this_rq();
+    rq_lock(q);
+    if (q->nr_running) {
+        timer_tick_start();
+        if (current_task_TCB == c->idle_task || c->need_resched || rq_top_prio(q) < task_rank(current_task_TCB))
+            resched = 1;
+    }
+    rq_unlock(q);
+    if (resched)
+        schedule();
 }
\ No newline at end of file
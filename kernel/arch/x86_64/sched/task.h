@@ -3,7 +3,10 @@
 
 #include <stdint.h>
 #include <kernel/list.h>
+#include <kernel/heap.h>
+#include <kernel/timer.h>
 #include "../mm/mm.h"
+#include "../cpu/smp.h"
 
 typedef enum {
     RUNNING,
@@ -11,34 +14,107 @@ typedef enum {
     PAUSED,
     SLEEPING,
     TERMINATED,
-    WAITING_FOR_LOCK
+    WAITING                                 /* 在wait_queue上睡眠 */
 } state_t;
 
+/* 优先级，0最高 */
+#define NR_PRIO                 8
+#define DEFAULT_PRIO            4
+
+/* fair调度类的权重，NICE_0_WEIGHT为默认权重 */
+#define NICE_0_WEIGHT        1024
+
+/* 调度类：SCHED_PRIO按优先级抢占，总是先于SCHED_FAIR；SCHED_FAIR按加权的虚拟运行时间分配CPU */
+typedef enum {
+    SCHED_FAIR,
+    SCHED_PRIO
+} policy_t;
+
+struct mutex;
+
 struct thread_control_block {
     unsigned long task_id;
     struct mm_struct *mm;
     state_t state;                          /* state field */
-    unsigned long time_used;
-    unsigned long sleep_expiry;
+    unsigned long time_used;                /* 运行过的时间（ns） */
+    unsigned long last_ran;                 /* 最后一次运行的tick，负载均衡据此判断cache是否还热 */
+    struct ktimer sleep_timer;              /* nano_sleep_until用的定时器，到期时唤醒任务 */
+    unsigned int priority;                  /* 实际使用的优先级和调度类，被优先级继承提升时不同于normal_* */
+    unsigned int cpu;                       /* 所在的（或最后运行的）CPU，就绪时在该CPU的队列中 */
+    policy_t policy;
+    unsigned long weight;
+    unsigned long vruntime;                 /* 加权后的运行时间（ns），fair调度类按它从小到大选取 */
+    unsigned int normal_priority;           /* set_task_priority/set_task_weight设置的基准值 */
+    policy_t normal_policy;
+    struct mutex *blocked_on;               /* 正在睡眠等待的mutex */
+    struct list_head pi_mutexes;            /* 持有的、有任务在等的mutex */
+    void *fpu_state;                        /* FPU/SSE状态的保存区，第一次用FPU时才分配 */
+    unsigned int fpu_cpu;                   /* 状态最后装入的CPU */
+    struct heap_node run_node;
 
     struct list_head tcb_list;
 };
 
+/* fair就绪队列：以vruntime为key的最小堆，正在运行的任务不在堆中 */
+struct fair_rq {
+    struct heap heap;
+    unsigned long min_vruntime;
+    unsigned long total_weight;             /* 堆中任务的权重之和 */
+};
+
+/* 就绪队列：每个CPU一个，每个优先级一个链表，bitmap记录非空的优先级，选取下一个任务为O(1) */
+struct run_queue {
+    ticket_lock_t lock;                     /* 加锁顺序见task.c开头 */
+    struct list_head queue[NR_PRIO];
+    uint32_t bitmap;
+    struct fair_rq fair;
+    unsigned int nr_running;
+    unsigned int cpu;
+    unsigned long time_slice_remaining;
+    unsigned long last_count;               /* 上次记账时的tick */
+    unsigned long last_clock;               /* 上次记账时的clock_ns */
+    unsigned long busy;                     /* 本均衡周期内非idle任务用掉的tick */
+    unsigned long util;                     /* 衰减平均的利用率，满载为UTIL_SCALE */
+    unsigned long next_balance;             /* 下一次周期负载均衡的tick */
+    unsigned long nr_migrated;              /* 迁入本队列的任务数 */
+};
+
+/* 任务在优先级上的排名，越小越优先，fair任务低于所有SCHED_PRIO的优先级 */
+static inline unsigned int task_rank(const struct thread_control_block *task) {
+    return task->policy == SCHED_PRIO ? task->priority : NR_PRIO;
+}
+
 extern void switch_to_task(struct thread_control_block *next_thread);
 void init_scheduler(void);
+void sched_init_ap(void);
 struct thread_control_block *create_task(void (*ent));
 void schedule();
 void lock_scheduler();
 void unlock_scheduler();
 void block_task(state_t reason);
 void unblock_task(struct thread_control_block *task);
+void wake_up_task(struct thread_control_block *task);
+void task_set_sched(struct thread_control_block *task, policy_t policy, unsigned int priority, unsigned long weight);
+void pi_update_prio(struct thread_control_block *task);
+int set_task_priority(struct thread_control_block *task, unsigned int priority);
+int set_task_weight(struct thread_control_block *task, unsigned long weight);
+int sched_set_latency(unsigned long target_latency, unsigned long min_granularity);
 void lock_stuff(void);
 void unlock_stuff(void);
+void preempt_disable(void);
+void preempt_enable(void);
 void nano_sleep_until(uint64_t when);
+void nano_sleep(unsigned long ns);
+void yield(void);
 void terminate_task(void);
 void task_hook_in_timer_handler(void);
+void resched_ipi_handler(void);
+void update_time_used(void);
 void kernel_idle_work(void);
+void task_pool_dump(void);
+void sched_dump(void);
 
-extern struct thread_control_block *current_task_TCB;
+/* 当前CPU上正在运行的任务 */
+#define current_task_TCB (this_cpu()->current)
 
 #endif
\ No newline at end of file
@@ -0,0 +1,49 @@
+#include "kernel/wait.h"
+#include "task.h"
+
+void wait_queue_init(struct wait_queue *wq) {
+    INIT_LIST_HEAD(&wq->head);
+}
+
+/* 调用者持有lock_scheduler：把wait挂到队列上并把当前任务设为WAITING，之后必须schedule()。
+   在两者之间可以根据队列上的等待者做些事情，比如优先级继承 */
+void prepare_to_wait(struct wait_queue *wq, struct wait_queue_entry *wait, int exclusive) {
+    wait->task = current_task_TCB;
+    wait->flags = exclusive ? WQ_FLAG_EXCLUSIVE : 0;
+    if (exclusive)
+        list_add_tail(&wait->entry, &wq->head);
+    else
+        list_add(&wait->entry, &wq->head);
+    current_task_TCB->state = WAITING;
+}
+
+/* 调用者持有最外层的lock_scheduler，且没有lock_stuff/preempt_disable：当前任务挂到队列上睡眠，
+   被唤醒后返回，返回时仍持有锁。唤醒不代表条件成立，调用者要在循环中重新检查 */
+void wait_queue_sleep(struct wait_queue *wq, int exclusive) {
+    struct wait_queue_entry wait;
+    prepare_to_wait(wq, &wait, exclusive);
+    schedule();
+}
+
+/* 调用者持有lock_scheduler；唤醒所有非独占的等待者和至多nr_exclusive个独占的等待者，nr_exclusive为0时全部唤醒 */
+unsigned int wake_up_locked(struct wait_queue *wq, unsigned int nr_exclusive) {
+    unsigned int woken = 0;
+    while (!list_empty(&wq->head)) {
+        struct wait_queue_entry *wait = container_of(wq->head.next, struct wait_queue_entry, entry);
+        unsigned int flags = wait->flags;
+        list_del(&wait->entry);
+        wake_up_task(wait->task);
+        woken++;
+        if ((flags & WQ_FLAG_EXCLUSIVE) && nr_exclusive && --nr_exclusive == 0)
+            break;
+    }
+    return woken;
+}
+
+/* 可以在中断中调用 */
+unsigned int wake_up(struct wait_queue *wq, unsigned int nr_exclusive) {
+    lock_scheduler();
+    unsigned int woken = wake_up_locked(wq, nr_exclusive);
+    unlock_scheduler();
+    return woken;
+}
@@ -2,15 +2,15 @@
 .type do_syscall, @function
 .align 4
 do_syscall:
-    /* load kernel segment reg */
+    /* load kernel segment reg, gs的基址指向per-CPU数据，不重新加载 */
     movl $0x10, %ebx
     movw %bx, %ds
     movw %bx, %es
     movw %bx, %fs
-    movw %bx, %gs
 
     /* save user stack */
-    mov current_task_TCB(%rip), %rbx
+    mov cpu_current_offset(%rip), %rbx
+    mov %gs:(%rbx), %rbx
     mov TCB_mm_offset(%rip), %r12
     mov (%rbx, %r12, 1), %rbx           # load mm into %rbx
     mov mm_rsp_offset(%rip), %r12
@@ -32,7 +32,8 @@ do_syscall:
     pop %rcx
 
     /* save kernel stack */
-    mov current_task_TCB(%rip), %rbx
+    mov cpu_current_offset(%rip), %rbx
+    mov %gs:(%rbx), %rbx
     mov TCB_mm_offset(%rip), %r12
     mov (%rbx, %r12, 1), %rbx           # load mm into %rbx
     mov mm_rsp0_offset(%rip), %r12
@@ -47,7 +48,6 @@ do_syscall:
     movw %bx, %ds
     movw %bx, %es
     movw %bx, %fs
-    movw %bx, %gs
 
     # mov $0x002, %r11                   # switch IF for now
     /* rip already stored in rcx */
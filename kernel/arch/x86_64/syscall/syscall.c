@@ -2,8 +2,7 @@
 #include <kernel/printk.h>
 #include <kernel/tty.h>
 #include "../sched/task.h"
-
-extern struct thread_control_block *current_task_TCB;
+#include "syscall.h"
 
 int sys_read(int fd, size_t size, char *buffer) {
     struct mm_struct *mm = current_task_TCB->mm;
@@ -32,11 +31,21 @@ int sys_putchar(int ic) {
     return 0;
 }
 
+void sys_exit(void) {
+    terminate_task();
+}
+
+void sys_yield(void) {
+    yield();
+}
+
 void * syscalls[] = {
-    sys_read,
-    sys_write,
-    sys_get_task_id,
-    sys_get_rsp0,
-    sys_putchar
+    [SYS_READ]          = sys_read,
+    [SYS_WRITE]         = sys_write,
+    [SYS_GET_TASK_ID]   = sys_get_task_id,
+    [SYS_GET_RSP0]      = sys_get_rsp0,
+    [SYS_PUTCHAR]       = sys_putchar,
+    [SYS_EXIT]          = sys_exit,
+    [SYS_YIELD]         = sys_yield
 };
 
@@ -0,0 +1,13 @@
+#ifndef _SYSCALL_H
+#define _SYSCALL_H
+
+/* 系统调用号，即syscalls[]的下标，与libc中的一致 */
+#define SYS_READ                0
+#define SYS_WRITE               1
+#define SYS_GET_TASK_ID         2
+#define SYS_GET_RSP0            3
+#define SYS_PUTCHAR             4
+#define SYS_EXIT                5
+#define SYS_YIELD               6
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef _KERNEL_BENCH_H
+#define _KERNEL_BENCH_H
+
+/* 内置的基准测试，命令行 bench 或 bench=ctx,yield,wakeup,sem,kmalloc,page,bitmap,syscall 选择要跑的项 */
+int bench_from_cmdline(void);
+
+#endif
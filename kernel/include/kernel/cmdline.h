@@ -0,0 +1,10 @@
+#ifndef _KERNEL_CMDLINE_H
+#define _KERNEL_CMDLINE_H
+
+#include <stddef.h>
+
+/* multiboot传入的内核命令行，以空格分隔的"key"或"key=value"，第一项通常是内核的路径 */
+const char *cmdline(void);
+int cmdline_get(const char *key, char *value, size_t size);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef _KERNEL_HEAP_H
+#define _KERNEL_HEAP_H
+
+#include <stddef.h>
+
+#define HEAP_NOT_QUEUED         ((unsigned int)-1)
+
+/* 侵入式二叉最小堆，节点嵌入在宿主结构中，index为节点在数组中的下标，删除/调整时不需要查找 */
+struct heap_node {
+    unsigned int index;
+};
+
+struct heap {
+    struct heap_node **nodes;
+    unsigned int size;
+    unsigned int capacity;
+    int (*less)(const struct heap_node *a, const struct heap_node *b);
+};
+
+int heap_init(struct heap *h, unsigned int capacity,
+              int (*less)(const struct heap_node *a, const struct heap_node *b));
+int heap_reserve(struct heap *h, unsigned int capacity);
+int heap_push(struct heap *h, struct heap_node *node);
+struct heap_node *heap_pop(struct heap *h);
+void heap_remove(struct heap *h, struct heap_node *node);
+void heap_update(struct heap *h, struct heap_node *node);
+
+static inline void heap_node_init(struct heap_node *node) {
+    node->index = HEAP_NOT_QUEUED;
+}
+
+static inline int heap_queued(const struct heap_node *node) {
+    return node->index != HEAP_NOT_QUEUED;
+}
+
+static inline struct heap_node *heap_top(const struct heap *h) {
+    return h->size ? h->nodes[0] : NULL;
+}
+
+#endif
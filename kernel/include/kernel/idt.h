@@ -5,6 +5,7 @@
 
 void idt_set_descriptor(uint8_t vector, void *isr, uint8_t flags);
 void load_idt();
+void load_idt_ap(void);
 inline void cli();
 inline void sti();
 
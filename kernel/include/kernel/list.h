@@ -73,6 +73,10 @@ static void list_del(struct list_head *entry) {
     entry->prev = LIST_POISON2;
 }
 
+static inline bool list_empty(const struct list_head *head) {
+    return head->next == head;
+}
+
 static void list_replace(struct list_head *old, struct list_head *new) {
     new->next = old->next;
     new->next->prev = new;
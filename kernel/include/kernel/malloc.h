@@ -8,6 +8,19 @@
 #define ALIGN                                        4
 #define MIN_SIZE              sizeof(struct list_head)
 
+/* 堆校验：
+ * kmcheck() 可随时调用；
+ * KMCHECK_PERIOD > 0 时由 kmcheck 任务每隔 KMCHECK_PERIOD 个 tick 校验一次；
+ * 定义 KMCHECK_DEBUG（如 CPPFLAGS=-DKMCHECK_DEBUG）时每次 kmalloc/kfree 都校验。
+ * 默认都不开启，kmalloc/kfree 不会有额外开销 */
+#ifndef KMCHECK_PERIOD
+#ifdef KMCHECK_DEBUG
+#define KMCHECK_PERIOD                           1000
+#else
+#define KMCHECK_PERIOD                              0
+#endif
+#endif
+
 typedef struct {
     struct list_head all;
     int used;
@@ -18,9 +31,30 @@ typedef struct {
     };
 } chunk;
 
+/* 堆统计，size class按chunk大小的log2划分，与free bin一致 */
+struct kmem_stat {
+    size_t class_used[NUM_SIZES];                           /* 每个size class已分配的字节数 */
+    size_t bin_free[NUM_SIZES];                             /* 每个bin中空闲的字节数 */
+    size_t largest_free;                                    /* 最大的空闲chunk */
+    size_t mem_used, mem_free, mem_meta;
+    size_t mag_cached;                                      /* 各CPU magazine中缓存的字节数，不计入mem_used */
+    size_t heap_pages;                                      /* chunk堆占用的页数 */
+    size_t large_pages;                                     /* 大块占用的页数 */
+    unsigned int nr_page_tags;                              /* 使用中的page_tag，上限MM_PAGE_NUM */
+    unsigned int nr_large;
+    unsigned long nr_alloc, nr_free;                        /* 累计的分配/释放次数 */
+    unsigned int frag;                                      /* 碎片率，千分比：1 - largest_free / mem_free */
+};
+
 void *kmalloc(size_t size);
 void kfree(void *mem);
+void *krealloc(void *mem, size_t size);
+void *kmalloc_aligned(size_t size, size_t align);
+void kmalloc_drain(void);
 int kmcheck(void);
 int km_freecheck(void);
+void kmem_get_stat(struct kmem_stat *st);
+void kmem_dump(void);
+void kmcheck_init(void);
 
 #endif
\ No newline at end of file
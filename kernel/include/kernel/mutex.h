@@ -0,0 +1,38 @@
+#ifndef _KERNEL_MUTEX_H
+#define _KERNEL_MUTEX_H
+
+#include <kernel/wait.h>
+
+/* 自适应互斥锁：持有者正在别的CPU上运行时先自旋等它释放，否则在等待队列上睡眠。
+   带优先级继承：持有者的优先级被提升到睡眠等待者中最高的，释放后恢复，解锁时先唤醒优先级最高的等待者。
+   不可重入，只能在任务上下文中使用 */
+struct mutex {
+    struct thread_control_block *owner;     /* NULL表示空闲 */
+    unsigned int nr_waiters;                /* 准备睡眠或正在睡眠的任务数，为0时解锁不用取调度器锁 */
+    struct wait_queue wait;
+    struct thread_control_block *pi_owner;  /* pi_node挂在哪个任务的pi_mutexes上，由lock_scheduler保护 */
+    struct list_head pi_node;
+    unsigned long nr_spin_acquired;         /* 自旋期间取得锁的次数 */
+    unsigned long nr_slept;                 /* 睡眠等待的次数 */
+};
+
+/* 条件变量，等待和通知都要配合同一个mutex；被唤醒后要重新检查条件 */
+struct condvar {
+    struct wait_queue wait;
+};
+
+void mutex_init(struct mutex *m);
+int mutex_trylock(struct mutex *m);
+void mutex_lock(struct mutex *m);
+void mutex_unlock(struct mutex *m);
+
+struct mutex* create_mutex(void);
+void acquire_mutex(struct mutex *m);
+void release_mutex(struct mutex *m);
+
+void cond_init(struct condvar *cv);
+void cond_wait(struct condvar *cv, struct mutex *m);
+void cond_signal(struct condvar *cv);
+void cond_broadcast(struct condvar *cv);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef _KERNEL_SERIAL_H
+#define _KERNEL_SERIAL_H
+
+/* COM1，115200 8N1，轮询发送；初始化后printk的输出也会写到串口，qemu用-serial stdio可以收到 */
+void serial_init(void);
+int serial_enabled(void);
+void serial_putchar(char c);
+
+#endif
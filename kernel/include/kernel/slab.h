@@ -0,0 +1,34 @@
+#ifndef _KERNEL_SLAB_H
+#define _KERNEL_SLAB_H
+
+#include <stddef.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+
+#define KMEM_CACHE_MAX                  16      /* 最多能创建的cache数 */
+#define KMEM_CACHE_MAX_EMPTY             2      /* 每个cache最多保留的空slab数，多余的还给页分配器 */
+
+struct kmem_cache {
+    const char *name;
+    size_t size;                                /* 对象大小，已对齐 */
+    size_t offset;                              /* 第一个对象在slab页内的偏移 */
+    unsigned int objs_per_slab;
+    void (*ctor)(void *obj);                    /* 每次kmem_cache_alloc时调用 */
+    spinlock_t lock;                            /* 保护下面的slab链表和统计 */
+
+    struct list_head slabs_partial;
+    struct list_head slabs_full;
+    struct list_head slabs_empty;
+    unsigned long nr_empty;
+
+    unsigned long nr_slabs;                     /* 持有的slab页数 */
+    unsigned long nr_active;                    /* 已分配的对象数 */
+    unsigned long hits;                         /* 从已有slab中分配 */
+    unsigned long misses;                       /* 需要新申请slab页 */
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+#endif
@@ -0,0 +1,249 @@
+#ifndef _KERNEL_SPINLOCK_H
+#define _KERNEL_SPINLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 关中断并返回之前的rflags，与irq_restore配对使用 */
+static inline unsigned long irq_save(void) {
+    unsigned long flags;
+    __asm__ volatile ("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(unsigned long flags) {
+    __asm__ volatile ("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+static inline void cpu_relax(void) {
+    __asm__ volatile ("pause" : : : "memory");
+}
+
+/*
+ * 三种自旋锁，都不可重入，持锁时不能睡眠。
+ * 中断处理程序里也会取的锁要用_irqsave版本，否则本CPU在持锁时被中断会死锁。
+ *   spinlock_t    test-and-test-and-set，临界区短、竞争少时开销最小
+ *   ticket_lock_t 排号，按到达顺序获得，竞争多时不会饿死
+ *   mcs_lock_t    排队，每个CPU在自己的节点上自旋，竞争多时不会让锁所在的cache行来回跳
+ * 另有写者优先的读写锁rwlock_t。
+ */
+
+typedef struct {
+    volatile int locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT           { 0 }
+
+static inline void spin_lock_init(spinlock_t *lock) {
+    lock->locked = 0;
+}
+
+static inline int spin_trylock(spinlock_t *lock) {
+    return !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+/* 先只读等待锁空闲再尝试交换，等待期间不会独占cache行 */
+static inline void spin_lock(spinlock_t *lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+            cpu_relax();
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline unsigned long spin_lock_irqsave(spinlock_t *lock) {
+    unsigned long flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+/* 确定调用时中断是打开的才能用，解锁时直接sti */
+static inline void spin_lock_irq(spinlock_t *lock) {
+    __asm__ volatile ("cli" : : : "memory");
+    spin_lock(lock);
+}
+
+static inline void spin_unlock_irq(spinlock_t *lock) {
+    spin_unlock(lock);
+    __asm__ volatile ("sti" : : : "memory");
+}
+
+typedef union {
+    uint32_t val;
+    struct {
+        uint16_t owner;                         /* 正在服务的号 */
+        uint16_t next;                          /* 下一个取到的号 */
+    } t;
+} ticket_lock_t;
+
+#define TICKET_LOCK_INIT        { 0 }
+
+static inline void ticket_lock_init(ticket_lock_t *lock) {
+    lock->val = 0;
+}
+
+static inline void ticket_lock(ticket_lock_t *lock) {
+    uint16_t me = __atomic_fetch_add(&lock->t.next, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&lock->t.owner, __ATOMIC_ACQUIRE) != me)
+        cpu_relax();
+}
+
+/* 只有没人排队时才取号 */
+static inline int ticket_trylock(ticket_lock_t *lock) {
+    ticket_lock_t old, new;
+    old.val = __atomic_load_n(&lock->val, __ATOMIC_RELAXED);
+    if (old.t.owner != old.t.next)
+        return 0;
+    new = old;
+    new.t.next++;
+    return __atomic_compare_exchange_n(&lock->val, &old.val, new.val, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* 只有持锁者会修改owner */
+static inline void ticket_unlock(ticket_lock_t *lock) {
+    __atomic_store_n(&lock->t.owner, (uint16_t)(lock->t.owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline unsigned long ticket_lock_irqsave(ticket_lock_t *lock) {
+    unsigned long flags = irq_save();
+    ticket_lock(lock);
+    return flags;
+}
+
+static inline void ticket_unlock_irqrestore(ticket_lock_t *lock, unsigned long flags) {
+    ticket_unlock(lock);
+    irq_restore(flags);
+}
+
+/* 读写锁，写者优先：有写者在等时新的读者不再进入，读多写少时读者之间不互相阻塞 */
+typedef struct {
+    volatile int readers;                       /* 持锁的读者数，-1表示写者持有 */
+    volatile unsigned int writers_waiting;
+} rwlock_t;
+
+#define RWLOCK_INIT             { 0, 0 }
+
+static inline void rwlock_init(rwlock_t *lock) {
+    lock->readers = 0;
+    lock->writers_waiting = 0;
+}
+
+static inline void read_lock(rwlock_t *lock) {
+    for (;;) {
+        while (__atomic_load_n(&lock->writers_waiting, __ATOMIC_RELAXED) ||
+               __atomic_load_n(&lock->readers, __ATOMIC_RELAXED) < 0)
+            cpu_relax();
+        int old = __atomic_load_n(&lock->readers, __ATOMIC_RELAXED);
+        if (old >= 0 && __atomic_compare_exchange_n(&lock->readers, &old, old + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+static inline void read_unlock(rwlock_t *lock) {
+    __atomic_fetch_sub(&lock->readers, 1, __ATOMIC_RELEASE);
+}
+
+static inline void write_lock(rwlock_t *lock) {
+    __atomic_fetch_add(&lock->writers_waiting, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&lock->readers, &expected, -1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        while (__atomic_load_n(&lock->readers, __ATOMIC_RELAXED) != 0)
+            cpu_relax();
+    }
+    __atomic_fetch_sub(&lock->writers_waiting, 1, __ATOMIC_RELAXED);
+}
+
+static inline void write_unlock(rwlock_t *lock) {
+    __atomic_store_n(&lock->readers, 0, __ATOMIC_RELEASE);
+}
+
+static inline unsigned long read_lock_irqsave(rwlock_t *lock) {
+    unsigned long flags = irq_save();
+    read_lock(lock);
+    return flags;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t *lock, unsigned long flags) {
+    read_unlock(lock);
+    irq_restore(flags);
+}
+
+static inline unsigned long write_lock_irqsave(rwlock_t *lock) {
+    unsigned long flags = irq_save();
+    write_lock(lock);
+    return flags;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t *lock, unsigned long flags) {
+    write_unlock(lock);
+    irq_restore(flags);
+}
+
+/* 每个等待者提供一个节点，持锁期间节点不能释放；节点通常放在栈上或每CPU的数据区中 */
+struct mcs_node {
+    struct mcs_node *volatile next;
+    volatile int locked;
+};
+
+typedef struct {
+    struct mcs_node *tail;                      /* 队尾，NULL表示锁空闲 */
+} mcs_lock_t;
+
+#define MCS_LOCK_INIT           { NULL }
+
+static inline void mcs_lock_init(mcs_lock_t *lock) {
+    lock->tail = NULL;
+}
+
+static inline void mcs_lock(mcs_lock_t *lock, struct mcs_node *node) {
+    node->next = NULL;
+    node->locked = 1;
+    struct mcs_node *prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    if (!prev)
+        return;
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+        cpu_relax();
+}
+
+static inline int mcs_trylock(mcs_lock_t *lock, struct mcs_node *node) {
+    struct mcs_node *expected = NULL;
+    node->next = NULL;
+    node->locked = 0;
+    return __atomic_compare_exchange_n(&lock->tail, &expected, node, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* 没有后继时把队尾清空；清空失败说明有人刚入队，等它挂上next再交给它 */
+static inline void mcs_unlock(mcs_lock_t *lock, struct mcs_node *node) {
+    struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (!next) {
+        struct mcs_node *expected = node;
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+            cpu_relax();
+    }
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline unsigned long mcs_lock_irqsave(mcs_lock_t *lock, struct mcs_node *node) {
+    unsigned long flags = irq_save();
+    mcs_lock(lock, node);
+    return flags;
+}
+
+static inline void mcs_unlock_irqrestore(mcs_lock_t *lock, struct mcs_node *node, unsigned long flags) {
+    mcs_unlock(lock, node);
+    irq_restore(flags);
+}
+
+#endif
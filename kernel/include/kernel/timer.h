@@ -1,8 +1,41 @@
 #ifndef _TIMER_H
 #define _TIMER_H
 
+#include <kernel/heap.h>
+
+#define TIMER_HZ                1000
+#define KTIMER_NONE             ((unsigned long)-1)
+#define NSEC_PER_SEC            1000000000UL
+#define NSEC_PER_TICK           (NSEC_PER_SEC / TIMER_HZ)
+
+/* 内核定时器，按到期的tick放在最小堆中；period为0时只触发一次 */
+struct ktimer {
+    struct heap_node node;
+    unsigned long expires;
+    unsigned long period;
+    void (*func)(struct ktimer *timer, void *data);         /* 在时钟中断中调用，不能睡眠 */
+    void *data;
+};
+
 void timer_handler(void);
 void timer_init(void);
 unsigned long get_timer_count();
+void timer_tick_start(void);
+void timer_tick_stop(unsigned long deadline);
+void timer_tick(void);
+void pit_delay(unsigned long us);
+
+void clock_init(void);
+unsigned long clock_ns(void);
+unsigned long clock_tsc_khz(void);
+const char *clock_name(void);
+void clock_delay_ns(unsigned long ns);
+
+int ktimer_init(struct ktimer *timer, void (*func)(struct ktimer *timer, void *data), void *data);
+void ktimer_destroy(struct ktimer *timer);
+void ktimer_start(struct ktimer *timer, unsigned long expires, unsigned long period);
+void ktimer_cancel(struct ktimer *timer);
+unsigned long ktimer_next_deadline(void);
+void ktimer_run(void);
 
-#endif
\ No newline at end of file
+#endif
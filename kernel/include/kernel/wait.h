@@ -0,0 +1,29 @@
+#ifndef _KERNEL_WAIT_H
+#define _KERNEL_WAIT_H
+
+#include <kernel/list.h>
+
+#define WQ_FLAG_EXCLUSIVE            0x1
+
+struct thread_control_block;
+
+/* 等待队列，由lock_scheduler保护：非独占的等待者放在队头，每次都全部唤醒；
+   独占的等待者放在队尾，按个数唤醒，避免一次释放叫醒所有人又只有一个能拿到 */
+struct wait_queue {
+    struct list_head head;
+};
+
+/* 放在等待者的栈上，唤醒者把它从队列中摘下 */
+struct wait_queue_entry {
+    struct thread_control_block *task;
+    unsigned int flags;
+    struct list_head entry;
+};
+
+void wait_queue_init(struct wait_queue *wq);
+void prepare_to_wait(struct wait_queue *wq, struct wait_queue_entry *wait, int exclusive);
+void wait_queue_sleep(struct wait_queue *wq, int exclusive);
+unsigned int wake_up_locked(struct wait_queue *wq, unsigned int nr_exclusive);
+unsigned int wake_up(struct wait_queue *wq, unsigned int nr_exclusive);
+
+#endif
@@ -0,0 +1,386 @@
+#include <stdint.h>
+#include <kernel/bench.h>
+#include <kernel/cmdline.h>
+#include <kernel/malloc.h>
+#include <kernel/semaphore.h>
+#include <kernel/string.h>
+#include <kernel/printk.h>
+#include <kernel/page.h>
+#include <kernel/idt.h>
+#include <kernel/timer.h>
+#include "../arch/x86_64/mm/pagemanager.h"
+#include "../arch/x86_64/mm/bitmap.h"
+#include "../arch/x86_64/sched/task.h"
+#include "../arch/x86_64/cpu/cpu.h"
+#include "../arch/x86_64/syscall/syscall.h"
+
+/*
+ * 用RDTSC计时的基准测试，只在BSP上跑（不启动AP），结果每项一行：
+ *   bench: <name> [<arg>=<n>] iters=<n> avg=<cycles> min=<cycles> max=<cycles>
+ * 前后有"bench: begin"和"bench: end"，方便脚本从串口输出中取出来比较；
+ * 紧接着begin的一行给出时钟和TSC频率，周期数按它换算成时间：
+ *   bench: clock source=<tsc|pit> tsc_khz=<n>
+ */
+
+#define BENCH_CTX_ITERS             10000
+#define BENCH_YIELD_ITERS           10000
+#define BENCH_WAKEUP_ITERS           1000
+#define BENCH_SEM_ITERS             10000
+#define BENCH_KMALLOC_ITERS          1000
+#define BENCH_PAGE_ITERS              256
+#define BENCH_SYSCALL_ITERS         10000
+#define BENCH_BITMAP_ITERS           1000
+#define BENCH_BITMAP_BITS           32768
+#define BENCH_NAME_MAX                 64
+
+extern void do_syscall();
+
+struct bench_stat {
+    unsigned long n;
+    unsigned long total;
+    unsigned long min;
+    unsigned long max;
+};
+
+static void stat_init(struct bench_stat *s) {
+    s->n = 0;
+    s->total = 0;
+    s->min = ~0UL;
+    s->max = 0;
+}
+
+static void stat_add(struct bench_stat *s, unsigned long cycles) {
+    s->n++;
+    s->total += cycles;
+    if (cycles < s->min)
+        s->min = cycles;
+    if (cycles > s->max)
+        s->max = cycles;
+}
+
+/* arg_name为NULL时不输出参数 */
+static void stat_report(const char *name, const char *arg_name, unsigned long arg, const struct bench_stat *s) {
+    unsigned long avg = s->n ? s->total / s->n : 0;
+    unsigned long min = s->n ? s->min : 0;
+    if (arg_name)
+        printk("bench: %s %s=%u iters=%u avg=%u min=%u max=%u\n", name, arg_name, arg, s->n, avg, min, s->max);
+    else
+        printk("bench: %s iters=%u avg=%u min=%u max=%u\n", name, s->n, avg, min, s->max);
+}
+
+/* 上下文切换：两个任务互相唤醒对方再暂停自己，一个来回是两次切换 */
+static struct thread_control_block *ping_task, *pong_task;
+static volatile int bench_stop;
+
+static void handoff(struct thread_control_block *to) {
+    lock_stuff();
+    unblock_task(to);
+    block_task(PAUSED);
+    unlock_stuff();
+}
+
+static void pong_work(void) {
+    for (;;) {
+        handoff(ping_task);
+        if (bench_stop) {
+            unblock_task(ping_task);
+            terminate_task();
+        }
+    }
+}
+
+static void bench_ctx_switch(void) {
+    struct bench_stat s;
+    stat_init(&s);
+    bench_stop = 0;
+    ping_task = current_task_TCB;
+    pong_task = create_task(pong_work);
+    if (!pong_task)
+        return;
+
+    handoff(pong_task);                         /* 热身，让pong第一次运行 */
+    for (unsigned int i = 0; i < BENCH_CTX_ITERS; ++i) {
+        unsigned long start = rdtsc();
+        handoff(pong_task);
+        stat_add(&s, (rdtsc() - start) / 2);
+    }
+    bench_stop = 1;
+    handoff(pong_task);
+    stat_report("ctx_switch", NULL, 0, &s);
+}
+
+/* yield来回：两个fair任务轮流让出CPU */
+static void yield_work(void) {
+    while (!bench_stop)
+        yield();
+    terminate_task();
+}
+
+static void bench_yield(void) {
+    struct bench_stat s;
+    stat_init(&s);
+    bench_stop = 0;
+    if (!create_task(yield_work))
+        return;
+
+    yield();
+    for (unsigned int i = 0; i < BENCH_YIELD_ITERS; ++i) {
+        unsigned long start = rdtsc();
+        yield();
+        stat_add(&s, (rdtsc() - start) / 2);
+    }
+    bench_stop = 1;
+    yield();
+    stat_report("yield", NULL, 0, &s);
+}
+
+/* 唤醒延迟：从unblock_task到被唤醒的高优先级任务开始运行，有唤醒抢占时它在unblock_task返回前就已运行 */
+static struct thread_control_block *wake_task;
+static struct bench_stat wake_stat;
+static volatile unsigned long wake_start;
+
+static void wake_work(void) {
+    for (;;) {
+        block_task(PAUSED);
+        if (bench_stop)
+            terminate_task();
+        stat_add(&wake_stat, rdtsc() - wake_start);
+    }
+}
+
+static void bench_wakeup(void) {
+    stat_init(&wake_stat);
+    bench_stop = 0;
+    wake_task = create_task(wake_work);
+    if (!wake_task)
+        return;
+    set_task_priority(wake_task, 0);
+
+    for (unsigned int i = 0; i < BENCH_WAKEUP_ITERS; ++i) {
+        while (wake_task->state != PAUSED)
+            yield();
+        wake_start = rdtsc();
+        unblock_task(wake_task);
+    }
+    while (wake_task->state != PAUSED)
+        yield();
+    bench_stop = 1;
+    unblock_task(wake_task);
+    stat_report("wakeup", NULL, 0, &wake_stat);
+}
+
+/* 信号量交接：释放一个让对方取得，再等对方释放另一个，一个来回是两次交接 */
+static struct semaphore *sem_ping, *sem_pong;
+
+static void sem_work(void) {
+    for (;;) {
+        acquire_semaphore(sem_ping);
+        release_semaphore(sem_pong);
+        if (bench_stop)
+            terminate_task();
+    }
+}
+
+static void bench_sem_handoff(void) {
+    struct bench_stat s;
+    stat_init(&s);
+    bench_stop = 0;
+    sem_ping = create_semaphore(1);
+    sem_pong = create_semaphore(1);
+    if (!sem_ping || !sem_pong)
+        return;
+    acquire_semaphore(sem_ping);                /* 两个都先占满，对方取的时候就要等 */
+    acquire_semaphore(sem_pong);
+    if (!create_task(sem_work))
+        return;
+
+    for (unsigned int i = 0; i <= BENCH_SEM_ITERS; ++i) {
+        if (i == BENCH_SEM_ITERS)
+            bench_stop = 1;
+        unsigned long start = rdtsc();
+        release_semaphore(sem_ping);
+        acquire_semaphore(sem_pong);
+        if (i > 0 && !bench_stop)               /* 第一轮包含任务的首次运行 */
+            stat_add(&s, (rdtsc() - start) / 2);
+    }
+    stat_report("sem_handoff", NULL, 0, &s);
+}
+
+/* 每个大小先连续分配再全部释放，分别统计；最后打印堆和页分配器的统计（kmem:和frames:行） */
+static void *kmalloc_slots[BENCH_KMALLOC_ITERS];
+
+static void bench_kmalloc(void) {
+    static const unsigned long sizes[] = {16, 64, 256, 1024, 4096, 16384};
+    for (unsigned int k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+        struct bench_stat sa, sf;
+        stat_init(&sa);
+        stat_init(&sf);
+        for (unsigned int i = 0; i < BENCH_KMALLOC_ITERS; ++i) {
+            unsigned long start = rdtsc();
+            kmalloc_slots[i] = kmalloc(sizes[k]);
+            stat_add(&sa, rdtsc() - start);
+        }
+        for (unsigned int i = 0; i < BENCH_KMALLOC_ITERS; ++i) {
+            if (!kmalloc_slots[i])
+                continue;
+            unsigned long start = rdtsc();
+            kfree(kmalloc_slots[i]);
+            stat_add(&sf, rdtsc() - start);
+        }
+        stat_report("kmalloc", "size", sizes[k], &sa);
+        stat_report("kfree", "size", sizes[k], &sf);
+    }
+    kmem_dump();
+}
+
+static struct page_alloc page_slots[BENCH_PAGE_ITERS];
+
+static void bench_pages(void) {
+    static const unsigned long counts[] = {1, 4, 16};
+    for (unsigned int k = 0; k < sizeof(counts) / sizeof(counts[0]); ++k) {
+        struct bench_stat sa, sf;
+        stat_init(&sa);
+        stat_init(&sf);
+        for (unsigned int i = 0; i < BENCH_PAGE_ITERS; ++i) {
+            unsigned long start = rdtsc();
+            page_slots[i] = alloc_pages(counts[k]);
+            stat_add(&sa, rdtsc() - start);
+        }
+        for (unsigned int i = 0; i < BENCH_PAGE_ITERS; ++i) {
+            if (!page_slots[i].page)
+                continue;
+            unsigned long start = rdtsc();
+            free_pages(&page_slots[i]);
+            stat_add(&sf, rdtsc() - start);
+        }
+        stat_report("alloc_pages", "pages", counts[k], &sa);
+        stat_report("free_pages", "pages", counts[k], &sf);
+    }
+}
+
+/* 位图分配：按给定占用率随机置位，每次找一个空位、置位后马上清掉，保持占用率不变 */
+static uint64_t bench_map[BITMAP_WORDS(BENCH_BITMAP_BITS)];
+
+static void bench_bitmap(void) {
+    static const unsigned long occupancy[] = {10, 50, 90};
+    unsigned long seed = 2342;
+    for (unsigned int k = 0; k < sizeof(occupancy) / sizeof(occupancy[0]); ++k) {
+        struct bench_stat s;
+        stat_init(&s);
+        bitmap_clear_range(bench_map, 0, BENCH_BITMAP_BITS);
+        for (unsigned int i = 0; i < BENCH_BITMAP_BITS; ++i) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            if ((seed >> 33) % 100 < occupancy[k])
+                bitmap_set_range(bench_map, i, 1);
+        }
+
+        uint64_t hint = 0;
+        for (unsigned int i = 0; i < BENCH_BITMAP_ITERS; ++i) {
+            unsigned long start = rdtsc();
+            int64_t index = bitmap_find_free_run(bench_map, BENCH_BITMAP_BITS, hint, 1);
+            if (index < 0)
+                index = bitmap_find_free_run(bench_map, BENCH_BITMAP_BITS, 0, 1);
+            if (index < 0)
+                break;
+            bitmap_set_range(bench_map, index, 1);
+            stat_add(&s, rdtsc() - start);
+            bitmap_clear_range(bench_map, index, 1);
+            hint = (index + 1) % BENCH_BITMAP_BITS;
+        }
+        stat_report("bitmap", "occupancy", occupancy[k], &s);
+    }
+}
+
+/* 系统调用来回：任务进入ring3后反复调用最简单的get_rsp0，结果留在syscall_stat中，做完后exit */
+static struct bench_stat syscall_stat;
+static volatile int syscall_done;
+
+/* do_syscall不保存rbx、r12，调用的C函数会改掉调用者保存的寄存器 */
+static inline unsigned long bench_syscall(unsigned long nr) {
+    unsigned long ret;
+    __asm__ volatile ("syscall" : "=a"(ret) : "a"(nr)
+                      : "rbx", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "memory");
+    return ret;
+}
+
+static void syscall_user_work(void) {
+    for (unsigned int i = 0; i < BENCH_SYSCALL_ITERS; ++i) {
+        unsigned long start = rdtsc();
+        bench_syscall(SYS_GET_RSP0);
+        stat_add(&syscall_stat, rdtsc() - start);
+    }
+    syscall_done = 1;
+    bench_syscall(SYS_EXIT);
+}
+
+static void syscall_work(void) {
+    get_to_ring3(syscall_user_work);
+}
+
+static void bench_syscall_roundtrip(void) {
+    stat_init(&syscall_stat);
+    syscall_done = 0;
+    if (!create_task(syscall_work))
+        return;
+    while (!syscall_done)
+        nano_sleep_until(get_timer_count() + 1);
+    stat_report("syscall", NULL, 0, &syscall_stat);
+}
+
+struct bench_case {
+    const char *name;
+    void (*run)(void);
+};
+
+static const struct bench_case bench_cases[] = {
+    {"ctx",     bench_ctx_switch},
+    {"yield",   bench_yield},
+    {"wakeup",  bench_wakeup},
+    {"sem",     bench_sem_handoff},
+    {"kmalloc", bench_kmalloc},
+    {"page",    bench_pages},
+    {"bitmap",  bench_bitmap},
+    {"syscall", bench_syscall_roundtrip},
+};
+
+static char bench_selection[BENCH_NAME_MAX];
+
+/* which为逗号分隔的名字，空串或"all"表示全部 */
+static int bench_selected(const char *which, const char *name) {
+    size_t nlen = strlen(name);
+    if (!*which || (strlen(which) == 3 && memcmp(which, "all", 3) == 0))
+        return 1;
+    while (*which) {
+        const char *end = which;
+        while (*end && *end != ',')
+            end++;
+        if ((size_t)(end - which) == nlen && memcmp(which, name, nlen) == 0)
+            return 1;
+        which = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+static void bench_work(void) {
+    printk("bench: begin\n");
+    printk("bench: clock source=%s tsc_khz=%u\n", clock_name(), clock_tsc_khz());
+    for (unsigned int i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); ++i)
+        if (bench_selected(bench_selection, bench_cases[i].name))
+            bench_cases[i].run();
+    printk("bench: end\n");
+    terminate_task();
+}
+
+/* 命令行里有bench或bench=<名字,...>时跑基准测试，不返回；没有时返回0 */
+int bench_from_cmdline(void) {
+    if (cmdline_get("bench", bench_selection, sizeof(bench_selection)) < 0)
+        return 0;
+
+    kalloc_frame_init();
+    init_scheduler();
+    set_ring0_msr(do_syscall);
+    create_task(bench_work);
+    sti();
+    kernel_idle_work();
+    return 1;
+}
@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include <kernel/cmdline.h>
+#include <kernel/string.h>
+#include "../multiboot/multiboot.h"
+
+extern void *p_multiboot_info;
+
+/* 引导器没有给命令行时返回空串 */
+const char *cmdline(void) {
+    multiboot_info_t *mbd = p_multiboot_info;
+    if (!mbd || !(mbd->flags & MULTIBOOT_INFO_CMDLINE) || !mbd->cmdline)
+        return "";
+    return (const char *)(uintptr_t)mbd->cmdline;
+}
+
+/* 查找key，没有时返回-1；有时把value（可能为空）复制到value中并返回它的长度，超出size的部分截掉 */
+int cmdline_get(const char *key, char *value, size_t size) {
+    const char *p = cmdline();
+    size_t klen = strlen(key);
+
+    while (*p) {
+        while (*p == ' ')
+            p++;
+        const char *tok = p;
+        while (*p && *p != ' ')
+            p++;
+        if ((size_t)(p - tok) < klen || memcmp(tok, key, klen) != 0 || (tok + klen != p && tok[klen] != '='))
+            continue;
+
+        const char *v = tok + klen;
+        if (v != p)
+            v++;
+        size_t len = p - v;
+        if (value && size) {
+            size_t n = len < size - 1 ? len : size - 1;
+            memcpy(value, v, n);
+            value[n] = '\0';
+        }
+        return (int)len;
+    }
+    return -1;
+}
@@ -9,12 +9,17 @@
 #include <kernel/list.h>
 #include <kernel/malloc.h>
 #include <kernel/semaphore.h>
+#include <kernel/mutex.h>
 #include <kernel/string.h>
 #include <kernel/printk.h>
 #include <kernel/pic.h>
+#include <kernel/serial.h>
+#include <kernel/bench.h>
 #include "../arch/x86_64/mm/pagemanager.h"
 #include "../arch/x86_64/sched/task.h"
+#include "../arch/x86_64/sched/rcu.h"
 #include "../arch/x86_64/cpu/cpu.h"
+#include "../arch/x86_64/cpu/smp.h"
 #include "../arch/x86_64/mm/pgtable.h"
 #include "../arch/x86_64/driver/floppy.h"
 #include "../arch/x86_64/fs/fat.h"
@@ -113,12 +118,8 @@ void test_mm(void) {
 /* test task */
 unsigned char ch_index = 0;
 
-extern int irq_disable_counter;
-extern int postpone_task_switches_counter;
-extern struct list_head *ready_tcb_list;
 extern struct list_head *paused_task_list;
 extern struct list_head *sleeping_task_list;
-extern unsigned long time_slice_remaining;
 
 int block_status = 1;
 extern unsigned long get_timer_count();
@@ -168,9 +169,7 @@ void test_task(void) {
         char *pattern = "[%s %u %u %u] ";
         printk("[%u ] ", current_task_TCB->task_id);
         // print_list(sleeping_task_list);
-        // print_list(ready_tcb_list);
         // print_list(paused_task_list);
-        print_list(smph->waiting_task_list);
         printk("smph->cur_count: %u ", smph->current_count);
         // printk("[outer %u]", ready_tcb_list);
         // list_size(ready_tcb_list);
@@ -360,18 +359,195 @@ void test_elf(void) {
     load_elf(&fs, "MAIN");
 }
 
+/* test smp: 任务分到各个CPU的就绪队列上，用qemu -smp N运行 */
+void smp_work(void) {
+    while (1) {
+        for (unsigned long i = 0; i < 300000000; ++i);
+        printk("[%u@cpu%u] ", current_task_TCB->task_id, (unsigned long)smp_processor_id());
+    }
+}
+
+void test_smp(void) {
+    kalloc_frame_init();
+    init_scheduler();
+    smp_init();
+    for (unsigned int i = 0; i < 8; ++i)
+        create_task(smp_work);
+    sched_dump();
+    sti();
+    kernel_idle_work();
+}
+
+/* 多个CPU上的任务争同一个mutex做计数，再用条件变量做生产者/消费者 */
+struct mutex test_mtx;
+struct condvar test_cv;
+unsigned long mutex_counter = 0, cv_items = 0;
+
+void mutex_work(void) {
+    for (unsigned long n = 1; ; ++n) {
+        mutex_lock(&test_mtx);
+        unsigned long v = mutex_counter;
+        for (unsigned long i = 0; i < 100000; ++i);
+        mutex_counter = v + 1;
+        mutex_unlock(&test_mtx);
+        if (n % 1000 == 0)
+            printk("[%u@cpu%u count %u spin %u slept %u] ", current_task_TCB->task_id, (unsigned long)smp_processor_id(),
+                   mutex_counter, test_mtx.nr_spin_acquired, test_mtx.nr_slept);
+    }
+}
+
+void producer_work(void) {
+    for (;;) {
+        for (unsigned long i = 0; i < 30000000; ++i);
+        mutex_lock(&test_mtx);
+        cv_items++;
+        cond_signal(&test_cv);
+        mutex_unlock(&test_mtx);
+    }
+}
+
+void consumer_work(void) {
+    for (;;) {
+        mutex_lock(&test_mtx);
+        while (cv_items == 0)
+            cond_wait(&test_cv, &test_mtx);
+        cv_items--;
+        mutex_unlock(&test_mtx);
+        printk("[%u got item] ", current_task_TCB->task_id);
+    }
+}
+
+void test_mutex(void) {
+    kalloc_frame_init();
+    init_scheduler();
+    smp_init();
+    mutex_init(&test_mtx);
+    cond_init(&test_cv);
+    for (unsigned int i = 0; i < 4; ++i)
+        create_task(mutex_work);
+    create_task(producer_work);
+    create_task(consumer_work);
+    create_task(consumer_work);
+    sti();
+    kernel_idle_work();
+}
+
+/* 单CPU上的优先级反转：低优先级任务持锁时高优先级任务来等，中优先级任务一直在算；
+   低优先级任务被提升到高优先级，先于中优先级任务跑完临界区 */
+struct mutex *pi_mtx = NULL;
+struct thread_control_block *pi_low = NULL;
+
+void pi_low_work(void) {
+    for (;;) {
+        acquire_mutex(pi_mtx);
+        for (unsigned long i = 0; i < 50000000; ++i);
+        printk("[low prio %u policy %u] ", (unsigned long)pi_low->priority, (unsigned long)pi_low->policy);
+        release_mutex(pi_mtx);
+        printk("[low released, prio %u policy %u] ", (unsigned long)pi_low->priority, (unsigned long)pi_low->policy);
+    }
+}
+
+void pi_medium_work(void) {
+    nano_sleep_until(get_timer_count() + 10);
+    for (;;)
+        for (unsigned long i = 0; i < 300000000; ++i);
+}
+
+void pi_high_work(void) {
+    for (;;) {
+        nano_sleep_until(get_timer_count() + 20);
+        acquire_mutex(pi_mtx);
+        printk("[high got lock] ");
+        release_mutex(pi_mtx);
+    }
+}
+
+void test_pi(void) {
+    kalloc_frame_init();
+    init_scheduler();
+    pi_mtx = create_mutex();
+    pi_low = create_task(pi_low_work);
+    set_task_priority(create_task(pi_medium_work), 2);
+    set_task_priority(create_task(pi_high_work), 0);
+    sti();
+    kernel_idle_work();
+}
+
+/* 读者在RCU读临界区中检查a + b不变，写者复制、修改后替换，旧版本在宽限期后释放 */
+struct rcu_config {
+    unsigned long a, b;
+    struct rcu_head rcu;
+};
+struct rcu_config *rcu_cfg = NULL;
+unsigned long rcu_freed = 0;
+
+static void rcu_config_free(struct rcu_head *head) {
+    kfree(container_of(head, struct rcu_config, rcu));
+    __atomic_fetch_add(&rcu_freed, 1, __ATOMIC_RELAXED);
+}
+
+void rcu_reader_work(void) {
+    for (unsigned long n = 1; ; ++n) {
+        rcu_read_lock();
+        struct rcu_config *cfg = rcu_dereference(rcu_cfg);
+        unsigned long a = cfg->a;
+        for (unsigned long i = 0; i < 10000; ++i);
+        if (a + cfg->b != 100)
+            printk("rcu: torn read %u + %u\n", a, cfg->b);
+        rcu_read_unlock();
+        if (n % 100000 == 0)
+            printk("[%u@cpu%u freed %u] ", current_task_TCB->task_id, (unsigned long)smp_processor_id(), rcu_freed);
+    }
+}
+
+void rcu_writer_work(void) {
+    for (;;) {
+        for (unsigned long i = 0; i < 10000000; ++i);
+        struct rcu_config *old = rcu_cfg;
+        struct rcu_config *cfg = kmalloc(sizeof(*cfg));
+        if (!cfg)
+            continue;
+        cfg->a = (old->a + 1) % 100;
+        cfg->b = 100 - cfg->a;
+        rcu_assign_pointer(rcu_cfg, cfg);
+        call_rcu(&old->rcu, rcu_config_free);
+    }
+}
+
+void test_rcu(void) {
+    kalloc_frame_init();
+    init_scheduler();
+    smp_init();
+    rcu_cfg = kmalloc(sizeof(*rcu_cfg));
+    rcu_cfg->a = 0;
+    rcu_cfg->b = 100;
+    for (unsigned int i = 0; i < 4; ++i)
+        create_task(rcu_reader_work);
+    create_task(rcu_writer_work);
+    sti();
+    kernel_idle_work();
+}
+
 extern void *page_map_level4;
 void kernel_main(void) {
     // load_gdt();
+    smp_early_init();
     terminal_initialize();
+    serial_init();
     PIC_init();
     // keyboard_init();
     load_idt();
     timer_init();
+    clock_init();
     NMI_enable();
     NMI_disable();
 
+    bench_from_cmdline();
     test_elf();
+    // test_smp();
+    // test_mutex();
+    // test_pi();
+    // test_rcu();
 
 
     // sti();
@@ -28,4 +28,12 @@ uint64_t get_rsp0() {
 
 int putchar(int ic) {
     return libc_do_syscall(4, ic, NULL, NULL, NULL, NULL, NULL);
+}
+
+void exit() {
+    libc_do_syscall(5, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+void yield() {
+    libc_do_syscall(6, NULL, NULL, NULL, NULL, NULL, NULL);
 }
\ No newline at end of file
@@ -9,6 +9,8 @@ uint64_t get_task_id();
 
 void exit();
 
+void yield();
+
 uint64_t get_rsp0();
 
 int putchar(int ic);
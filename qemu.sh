@@ -21,5 +21,7 @@ udisksctl loop-delete -b $(cat /tmp/SwallowOS.loop) || true
 qemu-system-$(./target-triplet-to-arch.sh $HOST) \
     -cdrom SwallowOS.iso \
     -m 2G \
+    -smp 4 \
     -drive file=floppy_disk.img,if=floppy,format=raw \
     -boot d \
+    -serial stdio \